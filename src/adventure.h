@@ -2,24 +2,225 @@
 #define SRC_ADVENTURE_H_
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <queue>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "../third_party/threadpool/threadpool.h"
+#include "./cancellation.h"
+#include "./costModel.h"
+#include "./crystalKernels.h"
+#include "./sandStorage.h"
 #include "./types.h"
 #include "./utils.h"
 
+// A crystal together with its position in the cavern.
+struct IndexedCrystal {
+  size_t index;
+  Crystal crystal;
+};
+
+// Which of several equally shiny best crystals to report.
+enum class Occurrence { FIRST, LAST };
+
 class Adventure {
+  friend class ArrangedSandView;
+  friend class CrystalIndex;
+  friend class CrystalStream;
+
  public:
   virtual ~Adventure() = default;
 
-  virtual uint64_t packEggs(std::vector<Egg> eggs, BottomlessBag& bag) = 0;
+  uint64_t packEggs(std::vector<Egg> eggs, BottomlessBag& bag) {
+    Cancellation never;
+    uint64_t packed = 0;
+    packEggsUntil(std::move(eggs), bag, never, packed);
+    return packed;
+  }
+
+  // Checks cancellation for every row of the table. Returns OK and sets
+  // packed, or why it stopped, leaving bag and packed untouched.
+  Status packEggs(std::vector<Egg> eggs, BottomlessBag& bag,
+                  Cancellation const& cancellation, uint64_t& packed) {
+    return packEggsUntil(std::move(eggs), bag, cancellation, packed);
+  }
+
+  virtual void arrangeSand(std::vector<GrainOfSand>& grains) {
+    Cancellation never;
+    arrangeSand(grains, never);
+  }
+
+  Status arrangeSand(std::vector<GrainOfSand>& grains,
+                     Cancellation const& cancellation) {
+    std::random_device rd;
+    return arrangeSandUntil(grains, (static_cast<uint64_t>(rd()) << 32) | rd(),
+                            cancellation, false);
+  }
+
+  // Every pivot is derived from the seed and the bounds of its subrange, so
+  // the same seed reproduces the same partitioning regardless of how the
+  // subranges are scheduled.
+  void arrangeSandSeeded(std::vector<GrainOfSand>& grains, uint64_t seed) {
+    Cancellation never;
+    arrangeSandUntil(grains, seed, never, true);
+  }
+
+  // Checks cancellation before every partition of a large subrange. When
+  // it stops, grains is left as some permutation of itself.
+  Status arrangeSandSeeded(std::vector<GrainOfSand>& grains, uint64_t seed,
+                           Cancellation const& cancellation) {
+    return arrangeSandUntil(grains, seed, cancellation, true);
+  }
+
+  // Arranges many independent deserts in one call; meant for traffic made of
+  // lots of small collections.
+  virtual void arrangeSandBatch(
+      std::vector<std::vector<GrainOfSand>>& deserts) = 0;
+
+  // Sorts the grains like arrangeSand, but aims at the fewest comparisons
+  // instead of the fewest memory operations. Returns the number of
+  // comparisons performed, which stays close to log2(n!).
+  virtual uint64_t arrangeSandFrugally(std::vector<GrainOfSand>& grains) = 0;
+
+  // External mode for deserts that do not fit in memory: sorts the sand file
+  // inputPath (see sandStorage.h) into outputPath, holding at most about
+  // memoryBudget bytes of grains in memory at a time.
+  virtual void arrangeSandExternally(std::string const& inputPath,
+                                     std::string const& outputPath,
+                                     size_t memoryBudget) = 0;
+
+  // Quickselect: moves the grain arrangeSand would put at position n there,
+  // with no greater grain before it and no smaller one after it, in
+  // expected O(n) time. Returns that grain.
+  GrainOfSand selectNth(std::vector<GrainOfSand>& grains, size_t n) {
+    if (n >= grains.size()) throw std::out_of_range("selectNth");
+    std::random_device rd;
+    std::vector<size_t> ranks{n};
+    selectRanks(grains, 0, grains.size() - 1, ranks.begin(), ranks.end(),
+                rd());
+    return grains[n];
+  }
+
+  // Arranges the k smallest grains, in order, at the front of grains. The
+  // order of the remaining grains is unspecified.
+  void partialArrange(std::vector<GrainOfSand>& grains, size_t k) {
+    k = std::min(k, grains.size());
+    if (k == 0) return;
+    if (k < grains.size()) selectNth(grains, k - 1);
+
+    std::vector<GrainOfSand> smallest(grains.begin(), grains.begin() + k);
+    arrangeSand(smallest);
+    std::copy(smallest.begin(), smallest.end(), grains.begin());
+  }
+
+  // Returns the grains at the given fractions (from 0 to 1) of the arranged
+  // desert, using the nearest rank. Selects all ranks in a single
+  // quickselect pass that only descends into subranges holding a rank.
+  std::vector<GrainOfSand> percentiles(std::vector<GrainOfSand>& grains,
+                                       std::vector<double> const& fractions) {
+    std::vector<GrainOfSand> result;
+    if (grains.empty()) return result;
 
-  virtual void arrangeSand(std::vector<GrainOfSand>& grains) = 0;
+    std::vector<size_t> ranks;
+    for (double fraction : fractions) {
+      fraction = std::min(std::max(fraction, 0.0), 1.0);
+      ranks.push_back(
+          static_cast<size_t>(fraction * (grains.size() - 1) + 0.5));
+    }
+    std::vector<size_t> sortedRanks = ranks;
+    std::sort(sortedRanks.begin(), sortedRanks.end());
+    sortedRanks.erase(std::unique(sortedRanks.begin(), sortedRanks.end()),
+                      sortedRanks.end());
+
+    std::random_device rd;
+    selectRanks(grains, 0, grains.size() - 1, sortedRanks.begin(),
+                sortedRanks.end(), rd());
+    for (size_t rank : ranks) result.push_back(grains[rank]);
+    return result;
+  }
+
+  // Adds a batch of new grains to an already arranged desert. Only the batch
+  // is sorted; it is then merged in by galloping through the arranged grains,
+  // so comparisons grow with the batch size rather than the desert size.
+  void arrangeSandIncremental(std::vector<GrainOfSand>& arranged,
+                              std::vector<GrainOfSand> newGrains) {
+    arrangeSand(newGrains);
+    std::vector<GrainOfSand> merged(arranged.size() + newGrains.size());
+    mergeArranged(arranged, newGrains, merged);
+    arranged.swap(merged);
+  }
 
   virtual Crystal selectBestCrystal(std::vector<Crystal>& crystals) = 0;
 
+  // Returns the best crystal with its index; the tie between equally shiny
+  // crystals is broken by occurrence the same way for any number of
+  // shamans. An empty cavern gives index crystals.size() and Crystal(0).
+  virtual IndexedCrystal selectBestCrystalIndex(
+      std::vector<Crystal>& crystals,
+      Occurrence occurrence = Occurrence::FIRST) = 0;
+
+  // Returns the k best crystals, best first. Equally shiny crystals are
+  // ordered by their index.
+  virtual std::vector<IndexedCrystal> selectBestCrystals(
+      std::vector<Crystal>& crystals, size_t k) = 0;
+
+  // Lets selectBestCrystal compare shininess with SIMD kernels instead of
+  // Crystal::operator<, for when the burden() cost model is not needed.
+  void setVectorizedCrystals(bool enabled) { vectorizedCrystals = enabled; }
+
+  // Start the step on a shaman and return at once; an adventure without
+  // shamans runs it before returning. Steps of one adventure may overlap.
+  // The bag and the grains or crystals are used in place: they must
+  // outlive the future and be left alone until it is ready.
+  std::future<uint64_t> packEggsAsync(std::vector<Egg> eggs,
+                                      BottomlessBag& bag) {
+    std::shared_ptr<std::vector<Egg>> owned =
+        std::make_shared<std::vector<Egg>>(std::move(eggs));
+    return inBackground<uint64_t>(
+        [this, owned, &bag] { return packEggs(std::move(*owned), bag); });
+  }
+
+  std::future<void> arrangeSandAsync(std::vector<GrainOfSand>& grains) {
+    return inBackground<void>([this, &grains] { arrangeSand(grains); });
+  }
+
+  std::future<Crystal> selectBestCrystalAsync(std::vector<Crystal>& crystals) {
+    return inBackground<Crystal>(
+        [this, &crystals] { return selectBestCrystal(crystals); });
+  }
+
  protected:
+  bool vectorizedCrystals = false;
+  const size_t INSERTION_RUN = 16;
+  const size_t RUN_STREAM_SHARE = 16;
+  const size_t MIN_GALLOP = 7;
+  const size_t CARDINALITY_SAMPLE = 256;
+  const size_t LOW_CARDINALITY_CONST = 64;
+  // smaller subranges are sorted without checking for cancellation
+  const size_t CANCELLATION_CHECK_GRAINS = 1 << 12;
+
+  typedef std::unordered_map<uint64_t, uint64_t> SizeCounts;
+
+  virtual Status packEggsUntil(std::vector<Egg> eggs, BottomlessBag& bag,
+                               Cancellation const& cancellation,
+                               uint64_t& packed) = 0;
+  // reproducible asks for the same partitioning on every run with the
+  // seed, which rules out splitting the work by measured costs.
+  virtual Status arrangeSandUntil(std::vector<GrainOfSand>& grains,
+                                  uint64_t seed,
+                                  Cancellation const& cancellation,
+                                  bool reproducible) = 0;
+
   size_t partition(std::vector<GrainOfSand>& grains, size_t lo, size_t hi) {
     GrainOfSand pivot = grains[hi];
 
@@ -35,17 +236,453 @@ class Adventure {
     return lastSmaller + 1;
   }
 
+  static uint64_t splitMix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  // Counter-based: the random stream of a subrange is keyed by its bounds,
+  // so concurrent subtasks need no shared generator state.
   void chooseRandomPivot(std::vector<GrainOfSand>& grains, size_t lo, size_t hi,
-                         std::mt19937& gen) {
-    std::uniform_int_distribution<int> dist(lo, hi - 1);
-    size_t randomId = dist(gen);
+                         uint64_t seed) {
+    uint64_t random = splitMix64(seed ^ splitMix64(lo) ^ splitMix64(~hi));
+    size_t randomId = lo + random % (hi - lo);
     std::swap(grains[randomId], grains[hi]);
   }
 
+  // Runs body over [0, count) split into contiguous chunks, one per shaman
+  // for adventures that have them, and returns once all chunks are done.
+  virtual void forEachChunk(
+      size_t count, std::function<void(size_t, size_t)> const& body) {
+    body(0, count);
+  }
+
+  // Starts job on a shaman if the adventure has any; otherwise runs it on
+  // the calling thread before returning.
+  virtual std::future<void> runInBackground(std::function<void()> job) {
+    std::packaged_task<void()> task(job);
+    task();
+    return task.get_future();
+  }
+
+  // runInBackground for a job with a result.
+  template <class R>
+  std::future<R> inBackground(std::function<R()> const& job) {
+    std::shared_ptr<std::packaged_task<R()>> task =
+        std::make_shared<std::packaged_task<R()>>(job);
+    std::future<R> result = task->get_future();
+    runInBackground([task] { (*task)(); });
+    return result;
+  }
+
+  void quickSortSequential(std::vector<GrainOfSand>& grains, size_t lo,
+                           size_t hi, uint64_t seed) {
+    if (lo < hi) {
+      chooseRandomPivot(grains, lo, hi, seed);
+      size_t pivot = partition(grains, lo, hi);
+
+      if (pivot != 0) quickSortSequential(grains, lo, pivot - 1, seed);
+      quickSortSequential(grains, pivot + 1, hi, seed);
+    }
+  }
+
+  // quickSortSequential that gives up on the subranges it has not reached
+  // once cancellation stops.
+  void quickSortCancellable(std::vector<GrainOfSand>& grains, size_t lo,
+                            size_t hi, uint64_t seed,
+                            Cancellation const& cancellation) {
+    if (lo >= hi) return;
+    if (hi - lo < CANCELLATION_CHECK_GRAINS) {
+      quickSortSequential(grains, lo, hi, seed);
+      return;
+    }
+    if (cancellation.stopped()) return;
+    chooseRandomPivot(grains, lo, hi, seed);
+    size_t pivot = partition(grains, lo, hi);
+
+    if (pivot != 0) {
+      quickSortCancellable(grains, lo, pivot - 1, seed, cancellation);
+    }
+    quickSortCancellable(grains, pivot + 1, hi, seed, cancellation);
+  }
+
+  // Lets ArrangedSandView hand a segment it will only need later to the
+  // adventure. The returned future is invalid if the segment is left to the
+  // view itself.
+  virtual std::future<void> refineInBackground(std::vector<GrainOfSand>& grains,
+                                               size_t lo, size_t hi,
+                                               uint64_t seed) {
+    return std::future<void>();
+  }
+
+  // Three-way partition around the grain at hi: the grains smaller than it
+  // go first, then those of its size, then the larger ones. Returns the
+  // first and last position of the middle band.
+  std::pair<size_t, size_t> partitionThreeWay(std::vector<GrainOfSand>& grains,
+                                              size_t lo, size_t hi) {
+    GrainOfSand pivot = grains[hi];
+
+    // [lo, firstEqual) are smaller, [firstEqual, i) equal and
+    // [firstLarger, hi) larger.
+    size_t firstEqual = lo, i = lo, firstLarger = hi;
+    while (i < firstLarger) {
+      if (grains[i] < pivot) {
+        std::swap(grains[firstEqual++], grains[i++]);
+      } else if (pivot < grains[i]) {
+        std::swap(grains[i], grains[--firstLarger]);
+      } else {
+        ++i;
+      }
+    }
+
+    std::swap(grains[firstLarger], grains[hi]);
+    return std::make_pair(firstEqual, firstLarger);
+  }
+
+  // Partition used by the selection queries, with partitionThreeWay's
+  // contract; adventures may swap in a concurrent one for large ranges.
+  // Every grain of the pivot's size lands in its final place at once, so
+  // deserts of few sizes still take a linear number of comparisons.
+  virtual std::pair<size_t, size_t> partitionForSelection(
+      std::vector<GrainOfSand>& grains, size_t lo, size_t hi) {
+    return partitionThreeWay(grains, lo, hi);
+  }
+
+  // Puts every rank in [firstRank, lastRank) (sorted, within [lo, hi]) in
+  // its arranged position.
+  void selectRanks(std::vector<GrainOfSand>& grains, size_t lo, size_t hi,
+                   std::vector<size_t>::iterator firstRank,
+                   std::vector<size_t>::iterator lastRank, uint64_t seed) {
+    while (firstRank != lastRank && lo < hi) {
+      chooseRandomPivot(grains, lo, hi, seed);
+      std::pair<size_t, size_t> band = partitionForSelection(grains, lo, hi);
+
+      // The ranks inside the band are settled.
+      auto bandRank = std::lower_bound(firstRank, lastRank, band.first);
+      auto afterBand = std::upper_bound(bandRank, lastRank, band.second);
+
+      if (bandRank != firstRank) {
+        selectRanks(grains, lo, band.first - 1, firstRank, bandRank, seed);
+      }
+      firstRank = afterBand;
+      lo = band.second + 1;
+    }
+  }
+
+  // Estimates from a random sample whether the grains take only a few
+  // distinct sizes, in which case counting them beats comparing them.
+  bool looksLowCardinality(std::vector<GrainOfSand> const& grains,
+                           uint64_t seed) {
+    if (grains.size() < 4 * CARDINALITY_SAMPLE) return false;
+
+    std::unordered_set<uint64_t> sizes;
+    for (size_t i = 0; i < CARDINALITY_SAMPLE; ++i) {
+      sizes.insert(grains[splitMix64(seed + i) % grains.size()].getSize());
+      if (sizes.size() > LOW_CARDINALITY_CONST) return false;
+    }
+    return true;
+  }
+
+  SizeCounts countSizes(std::vector<GrainOfSand> const& grains, size_t begin,
+                        size_t end) {
+    SizeCounts counts;
+    for (size_t i = begin; i < end; ++i) ++counts[grains[i].getSize()];
+    return counts;
+  }
+
+  // Orders the counted sizes and turns their counts into the positions at
+  // which each size starts in the arranged desert.
+  std::vector<std::pair<uint64_t, uint64_t>> sizeOffsets(
+      SizeCounts const& counts) {
+    std::vector<std::pair<uint64_t, uint64_t>> offsets(counts.begin(),
+                                                       counts.end());
+    std::sort(offsets.begin(), offsets.end());
+
+    uint64_t start = 0;
+    for (auto& it : offsets) {
+      uint64_t count = it.second;
+      it.second = start;
+      start += count;
+    }
+    return offsets;
+  }
+
+  // Writes positions [begin, end) of the arranged desert described by
+  // offsets.
+  void expandSizes(std::vector<GrainOfSand>& grains,
+                   std::vector<std::pair<uint64_t, uint64_t>> const& offsets,
+                   size_t begin, size_t end) {
+    auto startsAfter = [](size_t pos,
+                          std::pair<uint64_t, uint64_t> const& sizeOffset) {
+      return pos < sizeOffset.second;
+    };
+    size_t size = std::upper_bound(offsets.begin(), offsets.end(), begin,
+                                   startsAfter) -
+                  offsets.begin() - 1;
+    for (size_t i = begin; i < end; ++i) {
+      while (size + 1 < offsets.size() && offsets[size + 1].second <= i) {
+        ++size;
+      }
+      grains[i] = GrainOfSand(offsets[size].first);
+    }
+  }
+
+  // Sorts grains[begin, end) with a binary insertion sort, which needs only
+  // ceil(log2(k)) comparisons to insert the k-th grain.
+  uint64_t binaryInsertionSort(std::vector<GrainOfSand>& grains, size_t begin,
+                               size_t end) {
+    uint64_t comparisons = 0;
+    for (size_t i = begin + 1; i < end; ++i) {
+      GrainOfSand current = grains[i];
+      size_t lo = begin, hi = i;
+      while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        ++comparisons;
+        if (current < grains[mid]) {
+          hi = mid;
+        } else {
+          lo = mid + 1;
+        }
+      }
+
+      std::move_backward(grains.begin() + lo, grains.begin() + i,
+                         grains.begin() + i + 1);
+      grains[lo] = current;
+    }
+
+    return comparisons;
+  }
+
+  // Returns the length of the prefix of [first, last) for which pred holds,
+  // assuming pred is true on a prefix and false afterwards. Probes offsets
+  // 0, 1, 3, 7, ... and then binary searches the last gap, so a prefix of
+  // length k costs O(log k) calls.
+  template <class Pred>
+  size_t gallop(size_t first, size_t last, Pred pred) {
+    size_t lo = 0, probe = 0, step = 1;
+    while (first + probe < last && pred(first + probe)) {
+      lo = probe + 1;
+      probe += step;
+      step *= 2;
+    }
+
+    size_t hi = std::min(probe, last - first);
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (pred(first + mid)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    return lo;
+  }
+
+  // Stable merge of the sorted runs grains[begin, mid) and grains[mid, end).
+  // Switches to galloping once one run wins MIN_GALLOP times in a row.
+  uint64_t gallopingMerge(std::vector<GrainOfSand>& grains, size_t begin,
+                          size_t mid, size_t end,
+                          std::vector<GrainOfSand>& buffer) {
+    uint64_t comparisons = 0;
+    buffer.assign(grains.begin() + begin, grains.begin() + mid);
+
+    size_t left = 0, right = mid, out = begin;
+    size_t leftWins = 0, rightWins = 0;
+    while (left < buffer.size() && right < end) {
+      ++comparisons;
+      if (grains[right] < buffer[left]) {
+        grains[out++] = grains[right++];
+        ++rightWins;
+        leftWins = 0;
+      } else {
+        grains[out++] = buffer[left++];
+        ++leftWins;
+        rightWins = 0;
+      }
+
+      if (leftWins >= MIN_GALLOP && right < end) {
+        size_t taken = gallop(left, buffer.size(), [&](size_t pos) {
+          ++comparisons;
+          return !(grains[right] < buffer[pos]);
+        });
+        for (size_t i = 0; i < taken; ++i) grains[out++] = buffer[left++];
+        leftWins = 0;
+      } else if (rightWins >= MIN_GALLOP && left < buffer.size()) {
+        size_t taken = gallop(right, end, [&](size_t pos) {
+          ++comparisons;
+          return grains[pos] < buffer[left];
+        });
+        for (size_t i = 0; i < taken; ++i) grains[out++] = grains[right++];
+        rightWins = 0;
+      }
+    }
+
+    while (left < buffer.size()) grains[out++] = buffer[left++];
+    return comparisons;
+  }
+
+  // Merges batch[batchBegin, batchEnd) with arranged[arrangedBegin,
+  // arrangedEnd) into merged starting at mergedBegin. Arranged grains go
+  // before equal batch grains.
+  void gallopBatchInto(std::vector<GrainOfSand> const& arranged,
+                       size_t arrangedBegin, size_t arrangedEnd,
+                       std::vector<GrainOfSand> const& batch,
+                       size_t batchBegin, size_t batchEnd,
+                       std::vector<GrainOfSand>& merged, size_t mergedBegin) {
+    size_t next = arrangedBegin, out = mergedBegin;
+    for (size_t i = batchBegin; i < batchEnd; ++i) {
+      size_t taken = gallop(next, arrangedEnd, [&](size_t pos) {
+        return !(batch[i] < arranged[pos]);
+      });
+      std::copy(arranged.begin() + next, arranged.begin() + next + taken,
+                merged.begin() + out);
+      next += taken;
+      out += taken;
+      merged[out++] = batch[i];
+    }
+    std::copy(arranged.begin() + next, arranged.begin() + arrangedEnd,
+              merged.begin() + out);
+  }
+
+  virtual void mergeArranged(std::vector<GrainOfSand> const& arranged,
+                             std::vector<GrainOfSand> const& batch,
+                             std::vector<GrainOfSand>& merged) {
+    gallopBatchInto(arranged, 0, arranged.size(), batch, 0, batch.size(),
+                    merged, 0);
+  }
+
+  uint64_t mergeSortFrugal(std::vector<GrainOfSand>& grains, size_t begin,
+                           size_t end, std::vector<GrainOfSand>& buffer) {
+    if (end - begin <= INSERTION_RUN) {
+      return binaryInsertionSort(grains, begin, end);
+    }
+
+    size_t mid = begin + (end - begin) / 2;
+    uint64_t comparisons = mergeSortFrugal(grains, begin, mid, buffer) +
+                           mergeSortFrugal(grains, mid, end, buffer);
+    return comparisons + gallopingMerge(grains, begin, mid, end, buffer);
+  }
+
+  // Sorts the input one memory budget worth of grains at a time with
+  // arrangeSand and writes every sorted chunk to its own run file. The
+  // chunk leaves 1 / RUN_STREAM_SHARE of the budget for the buffer it is
+  // read or written through.
+  void cutSortedRuns(std::string const& inputPath,
+                     std::string const& outputPath, size_t memoryBudget,
+                     SandRuns& runs) {
+    uint64_t total = countGrains(inputPath);
+    uint64_t budgetGrains =
+        std::max<uint64_t>(memoryBudget / sizeof(GrainOfSand), 2);
+    size_t streamGrains =
+        std::max<uint64_t>(budgetGrains / RUN_STREAM_SHARE, 1);
+    uint64_t chunkGrains = budgetGrains - streamGrains;
+
+    std::vector<GrainOfSand> chunk;
+    for (uint64_t first = 0; first < total; first += chunkGrains) {
+      chunk.resize(std::min(chunkGrains, total - first));
+      {
+        SandReader reader(inputPath, first, chunk.size(), streamGrains);
+        for (auto& grain : chunk) reader.next(grain);
+      }
+
+      arrangeSand(chunk);
+
+      runs.paths.push_back(outputPath + ".run" +
+                           std::to_string(runs.paths.size()));
+      runs.lengths.push_back(chunk.size());
+      createSandFile(runs.paths.back());
+      SandWriter writer(runs.paths.back(), 0, streamGrains);
+      for (auto const& grain : chunk) writer.write(grain);
+      writer.flush();
+    }
+  }
+
+  // Splits the runs into parts key ranges of similar size. Range r covers
+  // positions [bounds[r][run], bounds[r + 1][run]) of every run, and all of
+  // its grains are smaller than those of range r + 1.
+  std::vector<std::vector<uint64_t>> chooseMergeBounds(
+      std::vector<std::string> const& runPaths,
+      std::vector<uint64_t> const& runLengths, size_t parts) {
+    const size_t SAMPLES_PER_PART = 8;
+    std::vector<std::vector<uint64_t>> bounds(parts + 1);
+    bounds.front().assign(runPaths.size(), 0);
+    bounds.back() = runLengths;
+    if (parts == 1 || runPaths.empty()) return bounds;
+
+    std::vector<SandFile> runs;
+    std::vector<GrainOfSand> samples;
+    for (size_t run = 0; run < runPaths.size(); ++run) {
+      runs.emplace_back(openSandFile(runPaths[run], "rb"));
+      for (size_t i = 0; i < parts * SAMPLES_PER_PART; ++i) {
+        uint64_t pos = runLengths[run] * i / (parts * SAMPLES_PER_PART);
+        samples.push_back(readGrainAt(runs[run].get(), pos));
+      }
+    }
+    std::sort(samples.begin(), samples.end());
+
+    for (size_t part = 1; part < parts; ++part) {
+      GrainOfSand splitter = samples[samples.size() * part / parts];
+      for (size_t run = 0; run < runs.size(); ++run) {
+        uint64_t lo = bounds[part - 1][run], hi = runLengths[run];
+        while (lo < hi) {
+          uint64_t mid = lo + (hi - lo) / 2;
+          if (readGrainAt(runs[run].get(), mid) < splitter) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        bounds[part].push_back(lo);
+      }
+    }
+
+    return bounds;
+  }
+
+  // K-way merges positions [from[run], to[run]) of every run into the
+  // output file, starting at grain outputStart.
+  void mergeRunRange(std::vector<std::string> const& runPaths,
+                     std::vector<uint64_t> const& from,
+                     std::vector<uint64_t> const& to,
+                     std::string const& outputPath, uint64_t outputStart,
+                     size_t bufferGrains) {
+    typedef std::pair<GrainOfSand, size_t> Head;
+    auto laterHead = [](Head const& a, Head const& b) {
+      return b.first < a.first;
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(laterHead)> heads(
+        laterHead);
+
+    std::vector<std::unique_ptr<SandReader>> readers;
+    for (size_t run = 0; run < runPaths.size(); ++run) {
+      readers.emplace_back(new SandReader(runPaths[run], from[run],
+                                          to[run] - from[run], bufferGrains));
+      GrainOfSand grain;
+      if (readers[run]->next(grain)) heads.push(Head(grain, run));
+    }
+
+    SandWriter writer(outputPath, outputStart, bufferGrains);
+    while (!heads.empty()) {
+      Head head = heads.top();
+      heads.pop();
+      writer.write(head.first);
+      if (readers[head.second]->next(head.first)) heads.push(head);
+    }
+    writer.flush();
+  }
+
   Crystal findMax(std::vector<Crystal>& crystals, size_t startPos,
                   size_t endPos) {
     Crystal result = Crystal(0);
-    if (startPos > endPos) return result;
+    if (startPos > endPos || endPos >= crystals.size()) return result;
+
+    if (vectorizedCrystals) {
+      return Crystal(maxShininess(crystals.data() + startPos,
+                                  endPos - startPos + 1));
+    }
 
     for (size_t i = startPos; i <= endPos; ++i) {
       if (result < crystals[i]) result = crystals[i];
@@ -54,12 +691,75 @@ class Adventure {
     return result;
   }
 
-  uint64_t removeSizeless(std::vector<Egg>& eggs, BottomlessBag& bag) {
+  IndexedCrystal findMaxIndex(std::vector<Crystal>& crystals, size_t begin,
+                              size_t end, Occurrence occurrence) {
+    IndexedCrystal result = {end, Crystal(0)};
+    if (begin >= end) return result;
+
+    if (vectorizedCrystals) {
+      Crystal best =
+          Crystal(maxShininess(crystals.data() + begin, end - begin));
+      for (size_t i = begin; i < end; ++i) {
+        if (crystals[i] == best) result.index = i;
+        if (crystals[i] == best && occurrence == Occurrence::FIRST) break;
+      }
+      result.crystal = best;
+      return result;
+    }
+
+    result.index = begin;
+    result.crystal = crystals[begin];
+    for (size_t i = begin + 1; i < end; ++i) {
+      bool replace = occurrence == Occurrence::FIRST
+                         ? result.crystal < crystals[i]
+                         : !(crystals[i] < result.crystal);
+      if (replace) {
+        result.index = i;
+        result.crystal = crystals[i];
+      }
+    }
+
+    return result;
+  }
+
+  static bool isBetter(IndexedCrystal const& a, IndexedCrystal const& b) {
+    if (b.crystal < a.crystal) return true;
+    if (a.crystal < b.crystal) return false;
+    return a.index < b.index;
+  }
+
+  // Keeps the k best crystals of [begin, end) in a bounded heap with the
+  // worst of them on top. Returns them best first.
+  std::vector<IndexedCrystal> bestInRange(std::vector<Crystal>& crystals,
+                                          size_t begin, size_t end, size_t k) {
+    std::vector<IndexedCrystal> heap;
+    if (k == 0) return heap;
+    heap.reserve(std::min(k, end - begin));
+
+    for (size_t i = begin; i < end; ++i) {
+      IndexedCrystal candidate = {i, crystals[i]};
+      if (heap.size() < k) {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end(), isBetter);
+      } else if (isBetter(candidate, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), isBetter);
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end(), isBetter);
+      }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), isBetter);
+    return heap;
+  }
+
+  // Moves the eggs of size 0 to sizeless, which recreateResult puts in the
+  // bag once the packing is done. Returns their weight.
+  uint64_t removeSizeless(std::vector<Egg>& eggs, std::vector<Egg>& sizeless) {
     uint64_t freeEggs = 0;
 
     for (size_t i = 0; i < eggs.size(); ++i) {
       if (eggs[i].getSize() == 0) {
-        bag.addEgg(eggs[i]);
+        sizeless.push_back(eggs[i]);
         freeEggs += eggs[i].getWeight();
         std::swap(eggs[i], eggs.back());
         eggs.pop_back();
@@ -69,8 +769,10 @@ class Adventure {
     return freeEggs;
   }
 
-  void recreateResult(BottomlessBag& bag, std::vector<Egg>& eggs,
+  void recreateResult(BottomlessBag& bag, std::vector<Egg> const& sizeless,
+                      std::vector<Egg>& eggs,
                       std::vector<std::vector<bool>>& from) {
+    for (Egg const& egg : sizeless) bag.addEgg(egg);
     uint64_t curLoad = bag.getCapacity();
     for (size_t item = eggs.size(); item >= 1; --item) {
       if (from[item][curLoad]) {
@@ -79,14 +781,14 @@ class Adventure {
       }
     }
   }
-};
 
-class LonesomeAdventure : public Adventure {
- public:
-  LonesomeAdventure() {}
-
-  uint64_t packEggs(std::vector<Egg> eggs, BottomlessBag& bag) override {
-    uint64_t freeEggs = removeSizeless(eggs, bag);
+  // The whole table on the calling thread, checking cancellation for
+  // every row.
+  Status packEggsSequential(std::vector<Egg>& eggs, BottomlessBag& bag,
+                            Cancellation const& cancellation,
+                            uint64_t& packed) {
+    std::vector<Egg> sizeless;
+    uint64_t freeEggs = removeSizeless(eggs, sizeless);
 
     std::vector<std::vector<uint64_t>> dp(eggs.size() + 1);
     std::vector<std::vector<bool>> from(eggs.size() + 1);
@@ -94,6 +796,7 @@ class LonesomeAdventure : public Adventure {
     for (auto& it : from) it.resize(bag.getCapacity() + 1);
 
     for (size_t item = 0; item <= eggs.size(); ++item) {
+      if (cancellation.stopped()) return cancellation.status();
       for (uint64_t curLoad = 0; curLoad <= bag.getCapacity(); ++curLoad) {
         from[item][curLoad] = false;
         if (item == 0 || curLoad == 0) {
@@ -114,121 +817,605 @@ class LonesomeAdventure : public Adventure {
       }
     }
 
-    recreateResult(bag, eggs, from);
-    return dp[eggs.size()][bag.getCapacity()] + freeEggs;
+    recreateResult(bag, sizeless, eggs, from);
+    packed = dp[eggs.size()][bag.getCapacity()] + freeEggs;
+    return Status::OK;
   }
+};
+
+class LonesomeAdventure : public Adventure {
+ public:
+  LonesomeAdventure() {}
 
-  void arrangeSand(std::vector<GrainOfSand>& grains) override {
+  void arrangeSandBatch(
+      std::vector<std::vector<GrainOfSand>>& deserts) override {
     std::random_device rd;
-    std::mt19937 gen(rd());
-    quickSortSequential(grains, 0, grains.size() - 1, gen);
+    uint64_t seed = rd();
+    for (size_t desert = 0; desert < deserts.size(); ++desert) {
+      arrangeSandSeeded(deserts[desert], splitMix64(seed + desert));
+    }
+  }
+
+  uint64_t arrangeSandFrugally(std::vector<GrainOfSand>& grains) override {
+    std::vector<GrainOfSand> buffer;
+    return mergeSortFrugal(grains, 0, grains.size(), buffer);
+  }
+
+  void arrangeSandExternally(std::string const& inputPath,
+                             std::string const& outputPath,
+                             size_t memoryBudget) override {
+    SandRuns runs;
+    cutSortedRuns(inputPath, outputPath, memoryBudget, runs);
+    std::vector<std::vector<uint64_t>> bounds =
+        chooseMergeBounds(runs.paths, runs.lengths, 1);
+
+    createSandFile(outputPath);
+    size_t bufferGrains =
+        memoryBudget / sizeof(GrainOfSand) / (runs.paths.size() + 1);
+    mergeRunRange(runs.paths, bounds[0], bounds[1], outputPath, 0,
+                  bufferGrains);
   }
 
   Crystal selectBestCrystal(std::vector<Crystal>& crystals) override {
     return findMax(crystals, 0, crystals.size() - 1);
   }
 
- private:
-  void quickSortSequential(std::vector<GrainOfSand>& grains, size_t lo,
-                           size_t hi, std::mt19937& gen) {
-    if (lo < hi) {
-      chooseRandomPivot(grains, lo, hi, gen);
-      size_t pivot = partition(grains, lo, hi);
+  IndexedCrystal selectBestCrystalIndex(
+      std::vector<Crystal>& crystals,
+      Occurrence occurrence = Occurrence::FIRST) override {
+    return findMaxIndex(crystals, 0, crystals.size(), occurrence);
+  }
 
-      if (pivot != 0) quickSortSequential(grains, lo, pivot - 1, gen);
-      quickSortSequential(grains, pivot + 1, hi, gen);
+  std::vector<IndexedCrystal> selectBestCrystals(std::vector<Crystal>& crystals,
+                                                 size_t k) override {
+    return bestInRange(crystals, 0, crystals.size(), k);
+  }
+
+ protected:
+  Status packEggsUntil(std::vector<Egg> eggs, BottomlessBag& bag,
+                       Cancellation const& cancellation,
+                       uint64_t& packed) override {
+    return packEggsSequential(eggs, bag, cancellation, packed);
+  }
+
+  Status arrangeSandUntil(std::vector<GrainOfSand>& grains, uint64_t seed,
+                          Cancellation const& cancellation, bool) override {
+    if (grains.empty()) return Status::OK;
+    if (looksLowCardinality(grains, seed)) {
+      expandSizes(grains, sizeOffsets(countSizes(grains, 0, grains.size())), 0,
+                  grains.size());
+      return Status::OK;
     }
+    quickSortCancellable(grains, 0, grains.size() - 1, seed, cancellation);
+    return cancellation.status();
   }
 };
 
-class TeamAdventure : public Adventure {
+// Asks a team adventure to borrow its shamans from the pool shared by the
+// process instead of starting a pool of its own.
+struct BorrowShamans {};
+
+// Pool is the kind of thread pool the shamans work in: ThreadPool or
+// WorkStealingPool.
+template <class Pool>
+class BasicTeamAdventure : public Adventure {
  public:
-  explicit TeamAdventure(uint64_t numberOfShamansArg)
+  // The shamans get a pool of their own, set up as options say.
+  explicit BasicTeamAdventure(uint64_t numberOfShamansArg,
+                              PoolOptions const& options = PoolOptions())
       : numberOfShamans(numberOfShamansArg),
-        councilOfShamans(numberOfShamansArg) {}
+        ownPool(new Pool(numberOfShamansArg, options)),
+        councilOfShamans(*ownPool, numberOfShamansArg) {}
 
-  uint64_t packEggs(std::vector<Egg> eggs, BottomlessBag& bag) override {
-    uint64_t freeEggs = removeSizeless(eggs, bag);
+  // The shamans are borrowed from the pool shared by the process, which
+  // starts on first use with a worker per hardware thread; at most
+  // numberOfShamans threads work on a step, and fewer on a smaller machine.
+  BasicTeamAdventure(uint64_t numberOfShamansArg, BorrowShamans)
+      : numberOfShamans(numberOfShamansArg),
+        councilOfShamans(sharedPool<Pool>(), numberOfShamansArg) {}
 
-    std::vector<std::vector<uint64_t>> dp(eggs.size() + 1);
-    std::vector<std::vector<bool>> from(eggs.size() + 1);
-    for (auto& it : dp) it.resize(bag.getCapacity() + 1);
-    for (auto& it : from) it.resize(bag.getCapacity() + 1);
+  // Large deserts get the whole council one after another. The small ones
+  // are binned by size and packed into groups of similar grain count, and
+  // every group is sorted sequentially by a single task, so the cost of a
+  // pool round trip is shared by the whole group.
+  void arrangeSandBatch(
+      std::vector<std::vector<GrainOfSand>>& deserts) override {
+    std::random_device rd;
+    uint64_t seed = rd();
 
-    for (size_t item = 0; item <= eggs.size(); ++item) {
-      std::future<void> previousColumn[numberOfShamans];
-      uint64_t newStart = 0;
-      for (size_t shaman = 0; shaman < numberOfShamans; ++shaman) {
-        uint64_t segmentLen =
-            (bag.getCapacity() + 1 - newStart) / (numberOfShamans - shaman);
-        uint64_t newEnd = newStart;
-        if (segmentLen > 0) newEnd = newStart + segmentLen - 1;
-
-        previousColumn[shaman] = councilOfShamans.enqueue(
-            [this, &dp, &from, &eggs, &bag, newStart, newEnd, item] {
-              dpSegment(item, newStart, newEnd, dp, from, eggs, bag);
-            });
-        newStart += segmentLen;
+    std::vector<size_t> order(deserts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&deserts](size_t a, size_t b) {
+      return deserts[a].size() > deserts[b].size();
+    });
+
+    size_t firstSmall = 0;
+    uint64_t smallGrains = 0;
+    for (size_t desert : order) {
+      if (deserts[desert].size() >= PARALLEL_DESERT_CONST) {
+        ++firstSmall;
+      } else {
+        smallGrains += deserts[desert].size();
       }
+    }
+    uint64_t groupGrains =
+        std::max<uint64_t>(smallGrains / (numberOfShamans * GROUPS_PER_SHAMAN),
+                           MIN_GROUP_GRAINS);
 
-      for (size_t shaman = 0; shaman < numberOfShamans; ++shaman) {
-        previousColumn[shaman].wait();
+    std::vector<std::future<void>> groups;
+    for (size_t first = firstSmall, last = firstSmall; first < order.size();
+         first = last) {
+      uint64_t grains = 0;
+      while (last < order.size() && grains < groupGrains) {
+        grains += deserts[order[last++]].size();
       }
+      groups.push_back(councilOfShamans.enqueue(
+          [this, &deserts, &order, first, last, seed] {
+            for (size_t i = first; i < last; ++i) {
+              std::vector<GrainOfSand>& grains = deserts[order[i]];
+              if (grains.empty()) continue;
+              quickSortSequential(grains, 0, grains.size() - 1,
+                                  splitMix64(seed + order[i]));
+            }
+          }));
     }
 
-    recreateResult(bag, eggs, from);
-    return dp[eggs.size()][bag.getCapacity()] + freeEggs;
+    for (size_t i = 0; i < firstSmall; ++i) {
+      arrangeSandSeeded(deserts[order[i]], splitMix64(seed + order[i]));
+    }
+    for (auto& it : groups) {
+      councilOfShamans.waitHelping(it);
+      it.get();
+    }
   }
 
-  void arrangeSand(std::vector<GrainOfSand>& grains) override {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    jobsActive = 1;
-    quickSortConcurrent(grains, 0, grains.size() - 1, gen);
+  // The comparisons counted depend on the runs, so they never follow
+  // from timings.
+  uint64_t arrangeSandFrugally(std::vector<GrainOfSand>& grains) override {
+    size_t runs = shamansBySize(grains.size(), MIN_FRUGAL_RUN);
+    if (runs <= 1) {
+      std::vector<GrainOfSand> buffer;
+      return mergeSortFrugal(grains, 0, grains.size(), buffer);
+    }
 
-    {
-      std::unique_lock<std::mutex> lock(sort_mutex);
-      all_done.wait(lock, [this] { return jobsActive == 0; });
+    std::vector<size_t> bounds(runs + 1);
+    for (size_t shaman = 0; shaman <= runs; ++shaman) {
+      bounds[shaman] = grains.size() * shaman / runs;
     }
+
+    auto sum = [](uint64_t a, uint64_t b) { return a + b; };
+    uint64_t comparisons = councilOfShamans.parallel_reduce(
+        0, runs, 1, uint64_t(0),
+        [this, &grains, &bounds](size_t run, size_t) {
+          std::vector<GrainOfSand> buffer;
+          return mergeSortFrugal(grains, bounds[run], bounds[run + 1], buffer);
+        },
+        sum);
+
+    while (bounds.size() > 2) {
+      std::vector<size_t> mergedBounds;
+      for (size_t run = 0; run + 2 < bounds.size(); run += 2) {
+        mergedBounds.push_back(bounds[run]);
+      }
+      if ((bounds.size() - 1) % 2 == 1) {
+        mergedBounds.push_back(bounds[bounds.size() - 2]);
+      }
+      mergedBounds.push_back(grains.size());
+
+      comparisons += councilOfShamans.parallel_reduce(
+          0, (bounds.size() - 1) / 2, 1, uint64_t(0),
+          [this, &grains, &bounds](size_t pair, size_t) {
+            std::vector<GrainOfSand> buffer;
+            return gallopingMerge(grains, bounds[2 * pair],
+                                  bounds[2 * pair + 1], bounds[2 * pair + 2],
+                                  buffer);
+          },
+          sum);
+      bounds.swap(mergedBounds);
+    }
+
+    return comparisons;
+  }
+
+  void arrangeSandExternally(std::string const& inputPath,
+                             std::string const& outputPath,
+                             size_t memoryBudget) override {
+    SandRuns runs;
+    cutSortedRuns(inputPath, outputPath, memoryBudget, runs);
+
+    // The merge waits on the files more than on burden(), which the cost
+    // model does not weigh.
+    uint64_t totalGrains =
+        std::accumulate(runs.lengths.begin(), runs.lengths.end(), uint64_t(0));
+    size_t ranges = shamansBySize(totalGrains, MIN_MERGE_RANGE);
+    std::vector<std::vector<uint64_t>> bounds =
+        chooseMergeBounds(runs.paths, runs.lengths, ranges);
+
+    createSandFile(outputPath);
+    size_t bufferGrains = memoryBudget / sizeof(GrainOfSand) /
+                          (ranges * (runs.paths.size() + 1));
+    std::vector<uint64_t> outputStarts(ranges + 1, 0);
+    for (size_t shaman = 0; shaman < ranges; ++shaman) {
+      outputStarts[shaman + 1] = outputStarts[shaman];
+      for (size_t run = 0; run < runs.paths.size(); ++run) {
+        outputStarts[shaman + 1] +=
+            bounds[shaman + 1][run] - bounds[shaman][run];
+      }
+    }
+
+    councilOfShamans.parallel_for(0, ranges, 1, [&](size_t shaman, size_t) {
+      mergeRunRange(runs.paths, bounds[shaman], bounds[shaman + 1], outputPath,
+                    outputStarts[shaman], bufferGrains);
+    });
   }
 
+  // A search not worth two shamans is a plain scan, without the partials
+  // of a reduction.
   Crystal selectBestCrystal(std::vector<Crystal>& crystals) override {
-    Crystal result = Crystal(0);
-    std::future<Crystal> segmentResults[numberOfShamans];
-
-    uint64_t newStart = 0;
-    for (size_t shaman = 0; shaman < numberOfShamans; ++shaman) {
-      uint64_t segmentLen =
-          (crystals.size() - newStart) / (numberOfShamans - shaman);
-      uint64_t newEnd = newStart;
-      if (segmentLen > 0) newEnd = newStart + segmentLen - 1;
-
-      segmentResults[shaman] =
-          councilOfShamans.enqueue([this, &crystals, newStart, newEnd] {
-            return findMax(crystals, newStart, newEnd);
-          });
-      newStart += segmentLen;
+    size_t grain = grainFor(crystals.size(), crystalNanos());
+    if (grain >= crystals.size()) {
+      return findMax(crystals, 0, crystals.size() - 1);
     }
+    return councilOfShamans.parallel_reduce(
+        0, crystals.size(), grain, Crystal(0),
+        [this, &crystals](size_t begin, size_t end) {
+          return findMax(crystals, begin, end - 1);
+        },
+        [](Crystal const& a, Crystal const& b) { return a < b ? b : a; });
+  }
 
-    for (size_t shaman = 0; shaman < numberOfShamans; ++shaman) {
-      Crystal resultHere = segmentResults[shaman].get();
-      if (result < resultHere) result = resultHere;
+  // The partial results of parallel_reduce sit on their own cache lines and
+  // are combined in chunk order, so ties resolve as in a single scan.
+  IndexedCrystal selectBestCrystalIndex(
+      std::vector<Crystal>& crystals,
+      Occurrence occurrence = Occurrence::FIRST) override {
+    size_t grain = grainFor(crystals.size(), burdenNanos());
+    if (grain >= crystals.size()) {
+      return findMaxIndex(crystals, 0, crystals.size(), occurrence);
     }
+    size_t none = crystals.size();
+    IndexedCrystal empty = {none, Crystal(0)};
+    return councilOfShamans.parallel_reduce(
+        0, crystals.size(), grain, empty,
+        [this, &crystals, occurrence](size_t begin, size_t end) {
+          return findMaxIndex(crystals, begin, end, occurrence);
+        },
+        [none, occurrence](IndexedCrystal const& result,
+                           IndexedCrystal const& chunkBest) {
+          if (chunkBest.index == none) return result;
+          bool replace = result.index == none ||
+                         (occurrence == Occurrence::FIRST
+                              ? result.crystal < chunkBest.crystal
+                              : !(chunkBest.crystal < result.crystal));
+          return replace ? chunkBest : result;
+        });
+  }
 
+  // Every shaman keeps the k best crystals of its contiguous chunk; the
+  // global k best are among the gathered candidates.
+  std::vector<IndexedCrystal> selectBestCrystals(std::vector<Crystal>& crystals,
+                                                 size_t k) override {
+    size_t grain = grainFor(crystals.size(), burdenNanos());
+    if (grain >= crystals.size()) {
+      return bestInRange(crystals, 0, crystals.size(), k);
+    }
+    typedef std::vector<IndexedCrystal> Candidates;
+    Candidates result = councilOfShamans.parallel_reduce(
+        0, crystals.size(), grain, Candidates(),
+        [this, &crystals, k](size_t begin, size_t end) {
+          return bestInRange(crystals, begin, end, k);
+        },
+        [](Candidates gathered, Candidates const& candidates) {
+          gathered.insert(gathered.end(), candidates.begin(), candidates.end());
+          return gathered;
+        });
+    std::sort(result.begin(), result.end(), isBetter);
+    if (result.size() > k) result.resize(k);
     return result;
   }
 
+ protected:
+  Status packEggsUntil(std::vector<Egg> eggs, BottomlessBag& bag,
+                       Cancellation const& cancellation,
+                       uint64_t& packed) override {
+    // Every cell may weigh an egg. A table whose rows are not worth two
+    // shamans is filled like a lonesome adventure does.
+    size_t loads = bag.getCapacity() + 1;
+    size_t grain = grainFor(loads, burdenNanos());
+    if (grain >= loads) {
+      return packEggsSequential(eggs, bag, cancellation, packed);
+    }
+
+    std::vector<Egg> sizeless;
+    uint64_t freeEggs = removeSizeless(eggs, sizeless);
+
+    // Rows are first written by the shamans that own their segments, so
+    // their pages are allocated on the NUMA nodes of those shamans.
+    DpTable dp;
+    dp.reserve(eggs.size() + 1);
+    for (size_t item = 0; item <= eggs.size(); ++item) dp.emplace_back(loads);
+    std::vector<std::vector<bool>> from(eggs.size() + 1);
+    for (auto& it : from) it.resize(loads);
+
+    // Segment k of every row goes to the same shaman, which still has it
+    // in its caches from the row before. Once cancelled, the segments
+    // still queued for the row return at once.
+    for (size_t item = 0; item <= eggs.size(); ++item) {
+      councilOfShamans.parallel_for_affine(
+          0, loads, grain, [&](size_t begin, size_t end) {
+            if (cancellation.stopped()) return;
+            dpSegment(item, begin, end - 1, dp, from, eggs, bag);
+          });
+      if (cancellation.status() != Status::OK) return cancellation.status();
+    }
+
+    recreateResult(bag, sizeless, eggs, from);
+    packed = dp[eggs.size()][bag.getCapacity()] + freeEggs;
+    return Status::OK;
+  }
+
+  Status arrangeSandUntil(std::vector<GrainOfSand>& grains, uint64_t seed,
+                          Cancellation const& cancellation,
+                          bool reproducible) override {
+    if (grains.empty()) return Status::OK;
+    if (looksLowCardinality(grains, seed)) {
+      arrangeByCounting(grains);
+      return Status::OK;
+    }
+    quickSortConcurrent(grains, seed, cancellation, reproducible);
+    return cancellation.status();
+  }
+
  private:
+  typedef std::vector<FirstTouchBuffer<uint64_t>> DpTable;
+
   uint64_t numberOfShamans;
-  ThreadPool councilOfShamans;
-  int jobsActive;
-  std::condition_variable all_done;
-  std::mutex sort_mutex;
+  // null when the shamans come from the shared pool
+  std::unique_ptr<Pool> ownPool;
+  PoolShare<Pool> councilOfShamans;
+  // segments per shaman of a reproducible quickSortConcurrent
   const size_t SPLITTING_CONST = 8;
+  // a segment sorted on its own is worth at least this many tasks
+  const double SEGMENT_TASKS_CONST = 16;
+  // a crystal compared by the SIMD kernels, and a grain counted by size
+  const double VECTORIZED_CRYSTAL_NANOS = 0.5;
+  const double COUNTED_GRAIN_NANOS = 20;
+  const size_t MIN_PARTITION_BLOCK = 1 << 13;
+  const size_t BACKGROUND_REFINE_CONST = 1 << 10;
+  const size_t PARALLEL_DESERT_CONST = 1 << 14;
+  // small deserts are batched into groups of at least this many grains
+  const size_t MIN_GROUP_GRAINS = 1 << 12;
+  // a frugal run below this costs more in merge comparisons than it saves
+  const size_t MIN_FRUGAL_RUN = 1 << 12;
+  // an external merge range below this spends its time opening run files
+  const size_t MIN_MERGE_RANGE = 1 << 12;
+  // a concurrent quicksort segment below this is not worth its own task
+  const size_t MIN_SEGMENT_GRAINS = 1 << 12;
+  const size_t GROUPS_PER_SHAMAN = 4;
 
-  void dpSegment(size_t item, uint64_t startPos, uint64_t endPos,
-                 std::vector<std::vector<uint64_t>>& dp,
-                 std::vector<std::vector<bool>>& from, std::vector<Egg> eggs,
+  // Chunk length that gives every shaman one chunk of count indices.
+  size_t grainPerShaman(size_t count) const {
+    return (count + numberOfShamans - 1) / numberOfShamans;
+  }
+
+  // What a step pays for every shaman but the first; measured once per
+  // pool, so adventures stay cheap to build.
+  double taskNanos() { return councilOfShamans.taskNanos(); }
+
+  // Shamans that finish a step of workNanos soonest. k of them take about
+  // workNanos / k + (k - 1) * taskNanos(), which is least for
+  // k = sqrt(workNanos / taskNanos()), but no more than the pool can run
+  // at once; a step that is not worth two shamans runs the sequential code
+  // on the calling thread.
+  size_t shamansFor(double workNanos) {
+    size_t most = councilOfShamans.threads();
+    if (most == 1) return 1;
+    double best = std::sqrt(workNanos / taskNanos());
+    return static_cast<size_t>(std::min<double>(std::max(best, 1.0), most));
+  }
+
+  // Chunk length that deals count items of itemNanos each to as many
+  // shamans as their work is worth.
+  size_t grainFor(size_t count, double itemNanos) {
+    size_t shamans = shamansFor(count * itemNanos);
+    return (count + shamans - 1) / shamans;
+  }
+
+  double crystalNanos() const {
+    return vectorizedCrystals ? VECTORIZED_CRYSTAL_NANOS : burdenNanos();
+  }
+
+  void forEachChunk(
+      size_t count,
+      std::function<void(size_t, size_t)> const& body) override {
+    councilOfShamans.parallel_for(0, count, grainPerShaman(count), body);
+  }
+
+  std::future<void> runInBackground(std::function<void()> job) override {
+    return councilOfShamans.enqueue(job);
+  }
+
+  std::future<void> refineInBackground(std::vector<GrainOfSand>& grains,
+                                       size_t lo, size_t hi,
+                                       uint64_t seed) override {
+    if (hi - lo < BACKGROUND_REFINE_CONST) return std::future<void>();
+    return councilOfShamans.enqueue([this, &grains, lo, hi, seed] {
+      quickSortSequential(grains, lo, hi, seed);
+    });
+  }
+
+  // Every shaman counts the sizes in its block into its own table; the
+  // tables are merged once and every shaman then expands its block of the
+  // arranged desert.
+  void arrangeByCounting(std::vector<GrainOfSand>& grains) {
+    size_t grain = grainFor(grains.size(), COUNTED_GRAIN_NANOS);
+    if (grain >= grains.size()) {
+      expandSizes(grains, sizeOffsets(countSizes(grains, 0, grains.size())),
+                  0, grains.size());
+      return;
+    }
+    SizeCounts counts = councilOfShamans.parallel_reduce(
+        0, grains.size(), grain, SizeCounts(),
+        [this, &grains](size_t begin, size_t end) {
+          return countSizes(grains, begin, end);
+        },
+        [](SizeCounts merged, SizeCounts const& blockCounts) {
+          for (auto const& sizeCount : blockCounts) {
+            merged[sizeCount.first] += sizeCount.second;
+          }
+          return merged;
+        });
+    std::vector<std::pair<uint64_t, uint64_t>> offsets = sizeOffsets(counts);
+
+    councilOfShamans.parallel_for(
+        0, grains.size(), grain, [&](size_t begin, size_t end) {
+          expandSizes(grains, offsets, begin, end);
+        });
+  }
+
+  // Cuts the batch into one slice per shaman the merge is worth and binary
+  // searches where each slice starts in the arranged grains; the slices
+  // then merge on their own. Every merged grain may cost a comparison.
+  void mergeArranged(std::vector<GrainOfSand> const& arranged,
+                     std::vector<GrainOfSand> const& batch,
+                     std::vector<GrainOfSand>& merged) override {
+    size_t slices = std::min<size_t>(
+        shamansFor((arranged.size() + batch.size()) * burdenNanos()),
+        std::max<size_t>(batch.size(), 1));
+    std::vector<size_t> batchBounds(slices + 1);
+    std::vector<size_t> arrangedBounds(slices + 1);
+    for (size_t shaman = 0; shaman <= slices; ++shaman) {
+      batchBounds[shaman] = batch.size() * shaman / slices;
+      if (shaman == 0) {
+        arrangedBounds[shaman] = 0;
+      } else if (batchBounds[shaman] == batch.size()) {
+        arrangedBounds[shaman] = arranged.size();
+      } else {
+        arrangedBounds[shaman] =
+            std::upper_bound(arranged.begin(), arranged.end(),
+                             batch[batchBounds[shaman]]) -
+            arranged.begin();
+      }
+    }
+
+    councilOfShamans.parallel_for(0, slices, 1, [&](size_t shaman, size_t) {
+      gallopBatchInto(arranged, arrangedBounds[shaman],
+                      arrangedBounds[shaman + 1], batch, batchBounds[shaman],
+                      batchBounds[shaman + 1], merged,
+                      arrangedBounds[shaman] + batchBounds[shaman]);
+    });
+  }
+
+  // Same contract as partitionThreeWay, but a large range is split in two
+  // concurrent passes: the smaller grains to the front, then the grains of
+  // the pivot's size to the front of the rest.
+  std::pair<size_t, size_t> partitionForSelection(
+      std::vector<GrainOfSand>& grains, size_t lo, size_t hi) override {
+    if (partitionBlocks(hi - lo) <= 1) {
+      return partitionThreeWay(grains, lo, hi);
+    }
+
+    GrainOfSand pivot = grains[hi];
+    size_t firstEqual = moveToFront(
+        grains, lo, hi,
+        [&pivot](GrainOfSand const& grain) { return grain < pivot; });
+    size_t firstLarger = moveToFront(
+        grains, firstEqual, hi,
+        [&pivot](GrainOfSand const& grain) { return !(pivot < grain); });
+
+    std::swap(grains[firstLarger], grains[hi]);
+    return std::make_pair(firstEqual, firstLarger);
+  }
+
+  // Shamans given count items of work, at least minimum items each. It
+  // follows from the size alone, for work that must not depend on timings.
+  size_t shamansBySize(uint64_t count, size_t minimum) const {
+    return static_cast<size_t>(std::max<uint64_t>(
+        std::min<uint64_t>(numberOfShamans, count / minimum), 1));
+  }
+
+  // Blocks a partition of count grains is split into, the same every time
+  // as seeded sorts require.
+  size_t partitionBlocks(size_t count) const {
+    return shamansBySize(count, MIN_PARTITION_BLOCK);
+  }
+
+  // Moves the grains of [lo, end) for which fits holds before the others
+  // and returns where the others start. Every shaman partitions its own
+  // block, and the grains left on the wrong side of the overall boundary
+  // are then swapped across it in place, so no scratch memory is needed.
+  template <class Fits>
+  size_t moveToFront(std::vector<GrainOfSand>& grains, size_t lo, size_t end,
+                     Fits const& fits) {
+    size_t blocks = partitionBlocks(end - lo);
+    if (blocks <= 1) {
+      size_t boundary = lo;
+      for (size_t i = lo; i < end; ++i) {
+        if (fits(grains[i])) std::swap(grains[boundary++], grains[i]);
+      }
+      return boundary;
+    }
+
+    std::vector<size_t> bounds(blocks + 1);
+    for (size_t shaman = 0; shaman <= blocks; ++shaman) {
+      bounds[shaman] = lo + (end - lo) * shaman / blocks;
+    }
+
+    std::vector<size_t> fitting(blocks);
+    councilOfShamans.parallel_for(0, blocks, 1, [&](size_t shaman, size_t) {
+      size_t split = bounds[shaman];
+      for (size_t i = bounds[shaman]; i < bounds[shaman + 1]; ++i) {
+        if (fits(grains[i])) std::swap(grains[split++], grains[i]);
+      }
+      fitting[shaman] = split - bounds[shaman];
+    });
+
+    size_t totalFitting = 0;
+    for (size_t shaman = 0; shaman < blocks; ++shaman) {
+      totalFitting += fitting[shaman];
+    }
+
+    // The other grains left of the boundary trade places with the fitting
+    // ones right of it, in place: the k-th of either kind, counted in block
+    // order, pair up. otherLeft and fitRight count them before each block.
+    size_t boundary = lo + totalFitting;
+    std::vector<size_t> otherLeft(blocks + 1, 0);
+    std::vector<size_t> fitRight(blocks + 1, 0);
+    for (size_t shaman = 0; shaman < blocks; ++shaman) {
+      size_t split = bounds[shaman] + fitting[shaman];
+      otherLeft[shaman + 1] =
+          otherLeft[shaman] +
+          (split < boundary ? std::min(bounds[shaman + 1], boundary) - split
+                            : 0);
+      fitRight[shaman + 1] =
+          fitRight[shaman] +
+          (split > boundary ? split - std::max(bounds[shaman], boundary) : 0);
+    }
+
+    size_t misplaced = otherLeft[blocks];
+    councilOfShamans.parallel_for(
+        0, misplaced, (misplaced + blocks - 1) / blocks,
+        [&](size_t first, size_t last) {
+          size_t l = std::upper_bound(otherLeft.begin(), otherLeft.end(),
+                                      first) -
+                     otherLeft.begin() - 1;
+          size_t r = std::upper_bound(fitRight.begin(), fitRight.end(),
+                                      first) -
+                     fitRight.begin() - 1;
+          for (size_t k = first; k < last; ++k) {
+            while (otherLeft[l + 1] <= k) ++l;
+            while (fitRight[r + 1] <= k) ++r;
+            std::swap(grains[bounds[l] + fitting[l] + (k - otherLeft[l])],
+                      grains[std::max(bounds[r], boundary) +
+                             (k - fitRight[r])]);
+          }
+        });
+
+    return boundary;
+  }
+
+  void dpSegment(size_t item, uint64_t startPos, uint64_t endPos, DpTable& dp,
+                 std::vector<std::vector<bool>>& from, std::vector<Egg>& eggs,
                  BottomlessBag& bag) {
     for (uint64_t curLoad = startPos; curLoad <= endPos; ++curLoad) {
       from[item][curLoad] = false;
@@ -249,40 +1436,180 @@ class TeamAdventure : public Adventure {
     }
   }
 
-  void quickSortConcurrent(std::vector<GrainOfSand>& grains, size_t lo,
-                           size_t hi, std::mt19937& gen) {
-    if (lo < hi) {
-      chooseRandomPivot(grains, lo, hi, gen);
-      size_t pivot = partition(grains, lo, hi);
+  // The top of the recursion runs in rounds: a round partitions every
+  // segment still above the cutoff, all at once, or one after another with
+  // every shaman when there are fewer segments than shamans. The remaining
+  // segments are then sorted one per task. The cost model picks the
+  // shamans, and as many segments as keep each worth SEGMENT_TASKS_CONST
+  // tasks; a desert not worth two shamans is sorted inline. A reproducible
+  // sort may not depend on timings, so it splits by size instead: every
+  // shaman from PARALLEL_DESERT_CONST grains on, into SPLITTING_CONST
+  // segments per shaman. Cancellation is checked before every round and
+  // inside the sorts.
+  void quickSortConcurrent(std::vector<GrainOfSand>& grains, uint64_t seed,
+                           Cancellation const& cancellation,
+                           bool reproducible) {
+    typedef std::pair<size_t, size_t> Segment;
+    size_t shamans, segments;
+    if (reproducible) {
+      shamans = grains.size() < PARALLEL_DESERT_CONST ? 1 : numberOfShamans;
+      segments = numberOfShamans * SPLITTING_CONST;
+    } else {
+      double work = grains.size() * std::log2(grains.size() + 1.0) *
+                    burdenNanos();
+      shamans = shamansFor(work);
+      segments = static_cast<size_t>(work /
+                                     (SEGMENT_TASKS_CONST * taskNanos()));
+    }
+    if (shamans == 1) {
+      quickSortCancellable(grains, 0, grains.size() - 1, seed, cancellation);
+      return;
+    }
+    size_t cutoff = std::max<size_t>(
+        grains.size() / std::max(segments, shamans), MIN_SEGMENT_GRAINS);
+    std::vector<Segment> splitting, sorting, next;
+    auto place = [&](size_t lo, size_t hi) {
+      (hi - lo >= cutoff ? next : sorting).push_back(Segment(lo, hi));
+    };
+    place(0, grains.size() - 1);
+    splitting.swap(next);
 
-      if (pivot != 0) {
-        {
-          std::lock_guard<std::mutex> lock(sort_mutex);
-          ++jobsActive;
-        }
-        if (hi - lo > SPLITTING_CONST) {
-          councilOfShamans.enqueue([this, &grains, lo, pivot, &gen] {
-            this->quickSortConcurrent(grains, lo, pivot - 1, gen);
-          });
-        } else {
-          quickSortConcurrent(grains, lo, pivot - 1, gen);
+    while (!splitting.empty()) {
+      if (cancellation.stopped()) return;
+      // the pivot of every segment, or the band of grains of its size
+      std::vector<Segment> pivots(splitting.size());
+      if (splitting.size() < shamans) {
+        for (size_t s = 0; s < splitting.size(); ++s) {
+          size_t lo = splitting[s].first, hi = splitting[s].second;
+          chooseRandomPivot(grains, lo, hi, seed);
+          pivots[s] = partitionForSelection(grains, lo, hi);
         }
+      } else {
+        councilOfShamans.parallel_for(
+            0, splitting.size(), 1, [&](size_t s, size_t) {
+              size_t lo = splitting[s].first, hi = splitting[s].second;
+              chooseRandomPivot(grains, lo, hi, seed);
+              size_t pivot = partition(grains, lo, hi);
+              pivots[s] = Segment(pivot, pivot);
+            });
       }
 
-      {
-        std::lock_guard<std::mutex> lock(sort_mutex);
-        ++jobsActive;
+      next.clear();
+      for (size_t s = 0; s < splitting.size(); ++s) {
+        size_t lo = splitting[s].first, hi = splitting[s].second;
+        if (pivots[s].first > lo + 1) place(lo, pivots[s].first - 1);
+        if (pivots[s].second + 1 < hi) place(pivots[s].second + 1, hi);
       }
-      quickSortConcurrent(grains, pivot + 1, hi, gen);
+      splitting.swap(next);
     }
 
-    {
-      std::lock_guard<std::mutex> lock(sort_mutex);
-      if (--jobsActive == 0) {
-        all_done.notify_all();
+    councilOfShamans.parallel_for(0, sorting.size(), 1, [&](size_t s, size_t) {
+      quickSortCancellable(grains, sorting[s].first, sorting[s].second, seed,
+                           cancellation);
+    });
+  }
+};
+
+typedef BasicTeamAdventure<ThreadPool> TeamAdventure;
+typedef BasicTeamAdventure<WorkStealingPool> StealingTeamAdventure;
+
+// Lazily arranged view of a desert, for consumers that read only the first
+// grains in order. Incremental quicksort: only the leftmost unsorted segment
+// is partitioned, when reading reaches it, so the first grain is ready in
+// expected O(n). The right segments split off on the way are handed to the
+// adventure, which may sort them in the background.
+class ArrangedSandView {
+ public:
+  class iterator {
+   public:
+    iterator(ArrangedSandView* viewArg, size_t posArg)
+        : view(viewArg), pos(posArg) {}
+
+    GrainOfSand const& operator*() const { return (*view)[pos]; }
+    iterator& operator++() {
+      ++pos;
+      return *this;
+    }
+    bool operator!=(iterator const& other) const { return pos != other.pos; }
+
+   private:
+    ArrangedSandView* view;
+    size_t pos;
+  };
+
+  ArrangedSandView(Adventure& adventureArg, std::vector<GrainOfSand>& grainsArg)
+      : ArrangedSandView(adventureArg, grainsArg, std::random_device()()) {}
+
+  ArrangedSandView(Adventure& adventureArg, std::vector<GrainOfSand>& grainsArg,
+                   uint64_t seedArg)
+      : adventure(adventureArg),
+        grains(grainsArg),
+        seed(seedArg),
+        sortedUntil(0),
+        pivots{grainsArg.size()} {}
+
+  ArrangedSandView(ArrangedSandView const&) = delete;
+  ArrangedSandView& operator=(ArrangedSandView const&) = delete;
+
+  ~ArrangedSandView() {
+    for (auto& it : refining) it.second.wait();
+  }
+
+  size_t size() const { return grains.size(); }
+
+  // Settles every grain up to pos in its arranged place.
+  GrainOfSand const& operator[](size_t pos) {
+    while (sortedUntil <= pos) settleNextSegment();
+    return grains[pos];
+  }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, grains.size()); }
+
+ private:
+  const size_t SMALL_SEGMENT_CONST = 16;
+
+  Adventure& adventure;
+  std::vector<GrainOfSand>& grains;
+  uint64_t seed;
+  // grains[0, sortedUntil) are in their arranged places.
+  size_t sortedUntil;
+  // Positions of settled pivots, nearest last. Every segment between two
+  // of them is unsorted, and grains.size() guards the bottom.
+  std::vector<size_t> pivots;
+  // Segments handed to the adventure, by their first position.
+  std::unordered_map<size_t, std::future<void>> refining;
+
+  void settleNextSegment() {
+    size_t end = pivots.back();
+    auto background = refining.find(sortedUntil);
+    if (background != refining.end()) {
+      background->second.get();
+      refining.erase(background);
+      settleUpTo(end);
+    } else if (end - sortedUntil <= SMALL_SEGMENT_CONST) {
+      if (end - sortedUntil > 1) {
+        adventure.quickSortSequential(grains, sortedUntil, end - 1, seed);
+      }
+      settleUpTo(end);
+    } else {
+      adventure.chooseRandomPivot(grains, sortedUntil, end - 1, seed);
+      size_t pivot = adventure.partition(grains, sortedUntil, end - 1);
+      if (pivot + 1 < end) {
+        std::future<void> refinement =
+            adventure.refineInBackground(grains, pivot + 1, end - 1, seed);
+        if (refinement.valid()) refining[pivot + 1] = std::move(refinement);
       }
+      pivots.push_back(pivot);
     }
   }
+
+  // Called once grains[sortedUntil, end) are sorted; the pivot at end, if
+  // any, is settled as well.
+  void settleUpTo(size_t end) {
+    pivots.pop_back();
+    sortedUntil = std::min(end + 1, grains.size());
+  }
 };
 
 #endif  // SRC_ADVENTURE_H_
@@ -0,0 +1,184 @@
+#ifndef SRC_ADVENTUREPIPELINE_H_
+#define SRC_ADVENTUREPIPELINE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "./adventure.h"
+#include "./types.h"
+
+// One request of the pipeline: eggs to pack into bag, grains to arrange and
+// crystals to search. The stages fill in packedWeight, arrange grains in
+// place and set bestCrystal.
+struct Expedition {
+  Expedition(std::vector<Egg> eggsArg, BottomlessBag bagArg,
+             std::vector<GrainOfSand> grainsArg,
+             std::vector<Crystal> crystalsArg)
+      : eggs(std::move(eggsArg)),
+        bag(bagArg),
+        packedWeight(0),
+        grains(std::move(grainsArg)),
+        crystals(std::move(crystalsArg)),
+        bestCrystal(0) {}
+
+  std::vector<Egg> eggs;
+  BottomlessBag bag;
+  uint64_t packedWeight;
+  std::vector<GrainOfSand> grains;
+  std::vector<Crystal> crystals;
+  Crystal bestCrystal;
+};
+
+// Runs egg packing, sand arrangement and crystal selection for a stream of
+// independent expeditions, with the three stages overlapping on the shared
+// pool. Every stage works on one expedition at a time, in submission order,
+// and hands it to a queue of at most maxQueued expeditions in front of the
+// next stage; a stage does not start while that queue is full, and submit
+// blocks while the first one is.
+//
+// The shamans are split between the stages with work every time a stage
+// starts, in proportion to how long each of them recently took per
+// expedition, so the slowest stage gets the most help.
+template <class Pool>
+class BasicAdventurePipeline {
+ public:
+  BasicAdventurePipeline(size_t shamansArg, size_t maxQueuedArg)
+      : shamans(std::max<size_t>(shamansArg, 1)),
+        maxQueued(std::max<size_t>(maxQueuedArg, 1)),
+        running(0) {
+    for (size_t stage = 0; stage < STAGES; ++stage) {
+      busy[stage] = false;
+      stageMillis[stage] = 1.0;
+    }
+  }
+
+  BasicAdventurePipeline(BasicAdventurePipeline const&) = delete;
+  BasicAdventurePipeline& operator=(BasicAdventurePipeline const&) = delete;
+
+  // Waits for every submitted expedition.
+  ~BasicAdventurePipeline() {
+    std::unique_lock<std::mutex> lock(pipeline_mutex);
+    stage_done.wait(lock, [this] { return running == 0; });
+  }
+
+  // Must not be called from a task of the shared pool, as it may block.
+  std::future<Expedition> submit(Expedition expedition) {
+    std::shared_ptr<Job> job = std::make_shared<Job>(std::move(expedition));
+    std::future<Expedition> result = job->result.get_future();
+
+    std::unique_lock<std::mutex> lock(pipeline_mutex);
+    stage_done.wait(lock, [this] { return queues[0].size() < maxQueued; });
+    queues[0].push_back(job);
+    ++running;
+    startStages();
+    return result;
+  }
+
+ private:
+  static const size_t STAGES = 3;
+  // weight of the latest expedition in the running time of a stage
+  static constexpr double RECENT_WEIGHT = 0.25;
+
+  struct Job {
+    explicit Job(Expedition expeditionArg)
+        : expedition(std::move(expeditionArg)) {}
+
+    Expedition expedition;
+    std::promise<Expedition> result;
+  };
+
+  size_t shamans;
+  size_t maxQueued;
+  // expeditions submitted and not finished yet
+  size_t running;
+  std::deque<std::shared_ptr<Job>> queues[STAGES];
+  bool busy[STAGES];
+  double stageMillis[STAGES];
+  std::mutex pipeline_mutex;
+  std::condition_variable stage_done;
+
+  // Starts every stage that is idle, has an expedition queued and room for
+  // it downstream. Called with pipeline_mutex held.
+  void startStages() {
+    for (size_t stage = 0; stage < STAGES; ++stage) {
+      if (busy[stage] || queues[stage].empty()) continue;
+      if (stage + 1 < STAGES && queues[stage + 1].size() >= maxQueued) {
+        continue;
+      }
+
+      std::shared_ptr<Job> job = queues[stage].front();
+      queues[stage].pop_front();
+      busy[stage] = true;
+      size_t stageShamans = shamansFor(stage);
+      sharedPool<Pool>().submit([this, job, stage, stageShamans] {
+        runStage(job, stage, stageShamans);
+      });
+    }
+  }
+
+  // The share of stage among the stages that have work. Called with
+  // pipeline_mutex held.
+  size_t shamansFor(size_t stage) const {
+    double total = 0;
+    for (size_t other = 0; other < STAGES; ++other) {
+      if (busy[other] || !queues[other].empty()) total += stageMillis[other];
+    }
+    size_t share = static_cast<size_t>(shamans * stageMillis[stage] / total +
+                                       0.5);
+    return std::min(std::max<size_t>(share, 1), shamans);
+  }
+
+  void runStage(std::shared_ptr<Job> job, size_t stage, size_t stageShamans) {
+    auto start = std::chrono::steady_clock::now();
+    bool failed = false;
+    try {
+      BasicTeamAdventure<Pool> adventure(stageShamans, BorrowShamans());
+      Expedition& expedition = job->expedition;
+      if (stage == 0) {
+        expedition.packedWeight =
+            adventure.packEggs(expedition.eggs, expedition.bag);
+      } else if (stage == 1) {
+        adventure.arrangeSand(expedition.grains);
+      } else {
+        expedition.bestCrystal = expedition.crystals.empty()
+                                     ? Crystal(0)
+                                     : adventure.selectBestCrystal(
+                                           expedition.crystals);
+      }
+    } catch (...) {
+      failed = true;
+      job->result.set_exception(std::current_exception());
+    }
+    double millis = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
+    bool finished = failed || stage + 1 == STAGES;
+    if (finished && !failed) job->result.set_value(std::move(job->expedition));
+
+    std::lock_guard<std::mutex> lock(pipeline_mutex);
+    stageMillis[stage] = (1 - RECENT_WEIGHT) * stageMillis[stage] +
+                         RECENT_WEIGHT * std::max(millis, 0.001);
+    busy[stage] = false;
+    if (finished) {
+      --running;
+    } else {
+      queues[stage + 1].push_back(job);
+    }
+    startStages();
+    stage_done.notify_all();
+  }
+};
+
+typedef BasicAdventurePipeline<ThreadPool> AdventurePipeline;
+typedef BasicAdventurePipeline<WorkStealingPool> StealingAdventurePipeline;
+
+#endif  // SRC_ADVENTUREPIPELINE_H_
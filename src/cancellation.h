@@ -0,0 +1,75 @@
+#ifndef SRC_CANCELLATION_H_
+#define SRC_CANCELLATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+// How an adventure step that may be stopped early ended.
+enum class Status { OK, CANCELLED, DEADLINE_EXCEEDED };
+
+// Stops adventure steps that take it, either when cancel() is called from
+// any thread or once the deadline passes. Steps check it cooperatively at
+// coarse points and skip the rest of their work once it is stopped, so
+// their tasks drain from the pool quickly. The first reason to stop is
+// kept; one token may be shared by several steps.
+class Cancellation {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  Cancellation()
+      : state(Status::OK),
+        deadline(Clock::time_point::max()),
+        checksLeft(NO_CHECK_LIMIT) {}
+  explicit Cancellation(Clock::time_point deadlineArg)
+      : state(Status::OK), deadline(deadlineArg), checksLeft(NO_CHECK_LIMIT) {}
+  explicit Cancellation(Clock::duration timeout)
+      : state(Status::OK),
+        deadline(Clock::now() + timeout),
+        checksLeft(NO_CHECK_LIMIT) {}
+  // Lets the first checks pass and cancels at the next check point, so a
+  // step checked from one thread stops at the same point on every run.
+  explicit Cancellation(uint64_t checks)
+      : state(Status::OK),
+        deadline(Clock::time_point::max()),
+        checksLeft(checks) {}
+
+  Cancellation(Cancellation const&) = delete;
+  Cancellation& operator=(Cancellation const&) = delete;
+
+  void cancel() { stop(Status::CANCELLED); }
+
+  // Checks the deadline too; meant for the check points of a step.
+  bool stopped() const {
+    if (state.load(std::memory_order_relaxed) != Status::OK) return true;
+    if (checksLeft.load(std::memory_order_relaxed) != NO_CHECK_LIMIT &&
+        checksLeft.fetch_sub(1) == 0) {
+      stop(Status::CANCELLED);
+      return true;
+    }
+    if (deadline == Clock::time_point::max() || Clock::now() < deadline) {
+      return false;
+    }
+    stop(Status::DEADLINE_EXCEEDED);
+    return true;
+  }
+
+  // Why the token stopped as seen by the check points so far, or OK.
+  Status status() const { return state.load(); }
+
+ private:
+  static constexpr uint64_t NO_CHECK_LIMIT =
+      std::numeric_limits<uint64_t>::max();
+
+  mutable std::atomic<Status> state;
+  Clock::time_point deadline;
+  mutable std::atomic<uint64_t> checksLeft;
+
+  void stop(Status reason) const {
+    Status running = Status::OK;
+    state.compare_exchange_strong(running, reason);
+  }
+};
+
+#endif  // SRC_CANCELLATION_H_
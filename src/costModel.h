@@ -0,0 +1,42 @@
+#ifndef SRC_COSTMODEL_H_
+#define SRC_COSTMODEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+
+#include "./types.h"
+
+// Rough costs, in nanoseconds, that team adventures weigh against the cost
+// of a task to decide how many shamans a step is worth.
+
+// The fastest of rounds timings of calls calls of fn, per call. Taking the
+// fastest round leaves out preemption and other noise.
+template <class F>
+double fastestNanosPerCall(size_t rounds, size_t calls, F const& fn) {
+  double fastest = std::numeric_limits<double>::max();
+  for (size_t round = 0; round < rounds; ++round) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t call = 0; call < calls; ++call) fn();
+    double nanos = std::chrono::duration<double, std::nano>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    fastest = std::min(fastest, nanos / calls);
+  }
+  return fastest;
+}
+
+// One call of burden(), which every comparison of grains or crystals and
+// every egg weight pays. Measured on first use.
+double burdenNanos() {
+  static std::atomic<double> measured(-1);
+  double nanos = measured.load(std::memory_order_relaxed);
+  if (nanos < 0) {
+    nanos = fastestNanosPerCall(5, 256, [] { burden(7, 3); });
+    measured.store(nanos, std::memory_order_relaxed);
+  }
+  return nanos;
+}
+
+#endif  // SRC_COSTMODEL_H_
@@ -0,0 +1,111 @@
+#ifndef SRC_CRYSTALINDEX_H_
+#define SRC_CRYSTALINDEX_H_
+
+#include <utility>
+#include <vector>
+
+#include "./adventure.h"
+#include "./types.h"
+
+// Range-max index over a mostly static cavern: answers "best crystal in
+// [lo, hi]" in O(BLOCK + log n) and takes point updates in the same time.
+// Crystals are grouped into blocks of BLOCK; a bottom-up segment tree is
+// kept over the block maxima only, so the tree is small enough to stay in
+// cache and the partial blocks at the ends of a query are short scans.
+class CrystalIndex {
+ public:
+  // The shamans of the adventure compute the block maxima and the lower
+  // tree levels in parallel.
+  CrystalIndex(Adventure& adventureArg, std::vector<Crystal> const& crystalsArg)
+      : adventure(adventureArg), crystals(crystalsArg), leaves(1) {
+    size_t blocks = (crystals.size() + BLOCK - 1) / BLOCK;
+    while (leaves < blocks) leaves *= 2;
+    tree.assign(2 * leaves, Crystal(0));
+
+    adventure.forEachChunk(blocks, [this](size_t begin, size_t end) {
+      for (size_t block = begin; block < end; ++block) refreshLeaf(block);
+    });
+
+    for (size_t first = leaves / 2; first >= 1; first /= 2) {
+      auto buildLevel = [this, first](size_t begin, size_t end) {
+        for (size_t node = first + begin; node < first + end; ++node) {
+          tree[node] = better(tree[2 * node], tree[2 * node + 1]);
+        }
+      };
+      if (first >= PARALLEL_LEVEL_CONST) {
+        adventure.forEachChunk(first, buildLevel);
+      } else {
+        buildLevel(0, first);
+      }
+    }
+  }
+
+  size_t size() const { return crystals.size(); }
+
+  // Best crystal in [lo, hi], or Crystal(0) for an empty range.
+  Crystal query(size_t lo, size_t hi) const {
+    Crystal result = Crystal(0);
+    if (lo > hi || hi >= crystals.size()) return result;
+
+    size_t firstBlock = lo / BLOCK, lastBlock = hi / BLOCK;
+    if (firstBlock == lastBlock) return scan(lo, hi + 1);
+
+    result = better(scan(lo, (firstBlock + 1) * BLOCK),
+                    scan(lastBlock * BLOCK, hi + 1));
+    for (size_t l = firstBlock + 1 + leaves, r = lastBlock + leaves; l < r;
+         l /= 2, r /= 2) {
+      if (l % 2 == 1) result = better(result, tree[l++]);
+      if (r % 2 == 1) result = better(result, tree[--r]);
+    }
+    return result;
+  }
+
+  // Answers a batch of inclusive ranges, spreading them over the shamans.
+  std::vector<Crystal> query(
+      std::vector<std::pair<size_t, size_t>> const& ranges) {
+    std::vector<Crystal> results(ranges.size());
+    adventure.forEachChunk(ranges.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        results[i] = query(ranges[i].first, ranges[i].second);
+      }
+    });
+    return results;
+  }
+
+  void update(size_t pos, Crystal crystal) {
+    crystals[pos] = crystal;
+    size_t node = refreshLeaf(pos / BLOCK);
+    for (node /= 2; node >= 1; node /= 2) {
+      tree[node] = better(tree[2 * node], tree[2 * node + 1]);
+    }
+  }
+
+ private:
+  static const size_t BLOCK = 16;
+  static const size_t PARALLEL_LEVEL_CONST = 1 << 12;
+
+  Adventure& adventure;
+  std::vector<Crystal> crystals;
+  // tree[leaves + block] holds the best crystal of block; every inner node
+  // holds the better of its children.
+  size_t leaves;
+  std::vector<Crystal> tree;
+
+  static Crystal better(Crystal const& a, Crystal const& b) {
+    return a < b ? b : a;
+  }
+
+  Crystal scan(size_t begin, size_t end) const {
+    Crystal result = Crystal(0);
+    for (size_t i = begin; i < end; ++i) result = better(result, crystals[i]);
+    return result;
+  }
+
+  size_t refreshLeaf(size_t block) {
+    size_t end = std::min((block + 1) * BLOCK, crystals.size());
+    tree[leaves + block] = scan(block * BLOCK, end);
+    return leaves + block;
+  }
+};
+
+#endif  // SRC_CRYSTALINDEX_H_
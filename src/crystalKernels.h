@@ -0,0 +1,91 @@
+#ifndef SRC_CRYSTALKERNELS_H_
+#define SRC_CRYSTALKERNELS_H_
+
+#include <algorithm>
+#include <type_traits>
+
+#include "./types.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SHAMANS_X86_KERNELS 1
+#endif
+
+// Max-reduction kernels over the shininess of crystals. They give the same
+// result as scanning with Crystal::operator< from Crystal(0), but skip the
+// burden() cost model.
+
+static_assert(std::is_standard_layout<Crystal>::value &&
+                  sizeof(Crystal) == sizeof(uint64_t),
+              "Crystal must be a bare shininess for the kernels");
+
+uint64_t maxShininessScalar(uint64_t const* shininess, size_t count) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < count; ++i) result = std::max(result, shininess[i]);
+  return result;
+}
+
+#ifdef SHAMANS_X86_KERNELS
+// AVX2 only compares signed 64-bit lanes, so the lanes are biased by the
+// sign bit to compare them as unsigned.
+__attribute__((target("avx2"))) uint64_t maxShininessAvx2(
+    uint64_t const* shininess, size_t count) {
+  const __m256i signBit = _mm256_set1_epi64x(INT64_MIN);
+  __m256i best0 = signBit, best1 = signBit;
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v0 = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<__m256i const*>(shininess + i)),
+        signBit);
+    __m256i v1 = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<__m256i const*>(shininess + i + 4)),
+        signBit);
+    best0 = _mm256_blendv_epi8(best0, v0, _mm256_cmpgt_epi64(v0, best0));
+    best1 = _mm256_blendv_epi8(best1, v1, _mm256_cmpgt_epi64(v1, best1));
+  }
+  best0 = _mm256_blendv_epi8(best0, best1, _mm256_cmpgt_epi64(best1, best0));
+
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes),
+                      _mm256_xor_si256(best0, signBit));
+  uint64_t result = maxShininessScalar(lanes, 4);
+  return std::max(result, maxShininessScalar(shininess + i, count - i));
+}
+
+// The masked max is used with a full mask because the unmasked one (and
+// the reduce helpers) trip GCC's uninitialized warnings in release builds.
+__attribute__((target("avx512f"))) uint64_t maxShininessAvx512(
+    uint64_t const* shininess, size_t count) {
+  const __mmask8 allLanes = 0xff;
+  __m512i best0 = _mm512_setzero_si512(), best1 = _mm512_setzero_si512();
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    best0 = _mm512_mask_max_epu64(best0, allLanes, best0,
+                                  _mm512_loadu_si512(shininess + i));
+    best1 = _mm512_mask_max_epu64(best1, allLanes, best1,
+                                  _mm512_loadu_si512(shininess + i + 8));
+  }
+  best0 = _mm512_mask_max_epu64(best0, allLanes, best0, best1);
+
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, best0);
+  uint64_t result = maxShininessScalar(lanes, 8);
+  return std::max(result, maxShininessScalar(shininess + i, count - i));
+}
+#endif
+
+// Picks the widest kernel the CPU supports.
+uint64_t maxShininess(Crystal const* crystals, size_t count) {
+  uint64_t const* shininess = reinterpret_cast<uint64_t const*>(crystals);
+#ifdef SHAMANS_X86_KERNELS
+  static const bool hasAvx512 = __builtin_cpu_supports("avx512f");
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  if (hasAvx512) return maxShininessAvx512(shininess, count);
+  if (hasAvx2) return maxShininessAvx2(shininess, count);
+#endif
+  return maxShininessScalar(shininess, count);
+}
+
+#endif  // SRC_CRYSTALKERNELS_H_
@@ -0,0 +1,82 @@
+#ifndef SRC_CRYSTALSTREAM_H_
+#define SRC_CRYSTALSTREAM_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "./adventure.h"
+#include "./types.h"
+
+// Selects the best crystal of a cavern that arrives in chunks from upstream
+// producers. Every pushed chunk is reduced on a shaman while the producer
+// goes on with the next one, and only a running best is kept. At most
+// maxChunksInFlight chunks are held at any time: push blocks until a shaman
+// frees a slot.
+class CrystalStream {
+ public:
+  CrystalStream(Adventure& adventureArg, size_t maxChunksInFlightArg)
+      : adventure(adventureArg),
+        maxChunksInFlight(std::max<size_t>(maxChunksInFlightArg, 1)),
+        chunksInFlight(0),
+        best(Crystal(0)) {}
+
+  CrystalStream(CrystalStream const&) = delete;
+  CrystalStream& operator=(CrystalStream const&) = delete;
+
+  ~CrystalStream() { waitForChunks(0); }
+
+  void push(std::vector<Crystal> chunk) {
+    waitForChunks(maxChunksInFlight - 1);
+    {
+      std::lock_guard<std::mutex> lock(stream_mutex);
+      ++chunksInFlight;
+    }
+
+    std::shared_ptr<std::vector<Crystal>> crystals =
+        std::make_shared<std::vector<Crystal>>();
+    crystals->swap(chunk);
+    adventure.runInBackground([this, crystals] {
+      Crystal chunkBest = adventure.findMax(*crystals, 0, crystals->size() - 1);
+      std::lock_guard<std::mutex> lock(stream_mutex);
+      if (best < chunkBest) best = chunkBest;
+      --chunksInFlight;
+      chunk_done.notify_all();
+    });
+  }
+
+  // Pulls chunks from produce until it returns false, pushing each of them.
+  void consume(std::function<bool(std::vector<Crystal>&)> const& produce) {
+    std::vector<Crystal> chunk;
+    while (produce(chunk)) {
+      push(std::move(chunk));
+      chunk.clear();
+    }
+  }
+
+  // Waits for every pushed chunk and returns the best crystal so far.
+  Crystal bestCrystal() {
+    waitForChunks(0);
+    std::lock_guard<std::mutex> lock(stream_mutex);
+    return best;
+  }
+
+ private:
+  Adventure& adventure;
+  size_t maxChunksInFlight;
+  size_t chunksInFlight;
+  Crystal best;
+  std::mutex stream_mutex;
+  std::condition_variable chunk_done;
+
+  void waitForChunks(size_t atMost) {
+    std::unique_lock<std::mutex> lock(stream_mutex);
+    chunk_done.wait(lock, [this, atMost] { return chunksInFlight <= atMost; });
+  }
+};
+
+#endif  // SRC_CRYSTALSTREAM_H_
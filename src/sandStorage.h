@@ -0,0 +1,162 @@
+#ifndef SRC_SANDSTORAGE_H_
+#define SRC_SANDSTORAGE_H_
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./types.h"
+
+// Sand files hold one native-endian uint64_t size per grain, with no header.
+
+std::FILE* openSandFile(std::string const& path, char const* mode) {
+  std::FILE* file = std::fopen(path.c_str(), mode);
+  if (file == nullptr) throw std::runtime_error("cannot open " + path);
+  // Readers and writers do their own large sequential buffering.
+  std::setvbuf(file, nullptr, _IONBF, 0);
+  return file;
+}
+
+struct SandFileCloser {
+  void operator()(std::FILE* file) const { std::fclose(file); }
+};
+
+// A sand file closed when it goes out of scope, also by an exception.
+typedef std::unique_ptr<std::FILE, SandFileCloser> SandFile;
+
+void seekGrain(std::FILE* file, uint64_t index) {
+  if (fseeko(file, static_cast<off_t>(index * sizeof(uint64_t)), SEEK_SET)) {
+    throw std::runtime_error("cannot seek in sand file");
+  }
+}
+
+uint64_t countGrains(std::string const& path) {
+  std::FILE* file = openSandFile(path, "rb");
+  fseeko(file, 0, SEEK_END);
+  off_t bytes = ftello(file);
+  std::fclose(file);
+  return static_cast<uint64_t>(bytes) / sizeof(uint64_t);
+}
+
+GrainOfSand readGrainAt(std::FILE* file, uint64_t index) {
+  uint64_t size = 0;
+  seekGrain(file, index);
+  if (std::fread(&size, sizeof(size), 1, file) != 1) {
+    throw std::runtime_error("short read from sand file");
+  }
+  return GrainOfSand(size);
+}
+
+// Streams grainCount grains starting at firstGrain, bufferGrains at a time.
+class SandReader {
+ public:
+  SandReader(std::string const& path, uint64_t firstGrain, uint64_t grainCount,
+             size_t bufferGrains)
+      : file(openSandFile(path, "rb")),
+        buffer(std::max<size_t>(bufferGrains, 1)),
+        position(0),
+        filled(0),
+        remaining(grainCount) {
+    seekGrain(file.get(), firstGrain);
+  }
+
+  SandReader(SandReader const&) = delete;
+  SandReader& operator=(SandReader const&) = delete;
+
+  bool next(GrainOfSand& grain) {
+    if (position == filled && !refill()) return false;
+    grain = GrainOfSand(buffer[position++]);
+    return true;
+  }
+
+ private:
+  SandFile file;
+  std::vector<uint64_t> buffer;
+  size_t position;
+  size_t filled;
+  uint64_t remaining;
+
+  bool refill() {
+    if (remaining == 0) return false;
+    size_t wanted = std::min<uint64_t>(buffer.size(), remaining);
+    filled = std::fread(buffer.data(), sizeof(uint64_t), wanted, file.get());
+    if (filled != wanted) throw std::runtime_error("short read from sand file");
+    remaining -= filled;
+    position = 0;
+    return true;
+  }
+};
+
+// Writes grains sequentially starting at firstGrain of an existing file, so
+// several writers can fill disjoint parts of one file concurrently.
+class SandWriter {
+ public:
+  SandWriter(std::string const& path, uint64_t firstGrain, size_t bufferGrains)
+      : file(openSandFile(path, "r+b")), filled(0) {
+    buffer.resize(std::max<size_t>(bufferGrains, 1));
+    seekGrain(file.get(), firstGrain);
+  }
+
+  SandWriter(SandWriter const&) = delete;
+  SandWriter& operator=(SandWriter const&) = delete;
+
+  void write(GrainOfSand const& grain) {
+    buffer[filled++] = grain.getSize();
+    if (filled == buffer.size()) flush();
+  }
+
+  void flush() {
+    if (std::fwrite(buffer.data(), sizeof(uint64_t), filled, file.get()) !=
+        filled) {
+      throw std::runtime_error("short write to sand file");
+    }
+    filled = 0;
+  }
+
+ private:
+  SandFile file;
+  std::vector<uint64_t> buffer;
+  size_t filled;
+};
+
+// The run files of one external sort, with their lengths in grains. The
+// files are removed with it, so a sort that throws leaves none behind.
+struct SandRuns {
+  SandRuns() {}
+  SandRuns(SandRuns const&) = delete;
+  SandRuns& operator=(SandRuns const&) = delete;
+  ~SandRuns() {
+    for (auto const& it : paths) std::remove(it.c_str());
+  }
+
+  std::vector<std::string> paths;
+  std::vector<uint64_t> lengths;
+};
+
+// Creates path, or truncates it if it already exists.
+void createSandFile(std::string const& path) {
+  std::fclose(openSandFile(path, "wb"));
+}
+
+void writeGrains(std::string const& path,
+                 std::vector<GrainOfSand> const& grains) {
+  createSandFile(path);
+  SandWriter writer(path, 0, grains.size());
+  for (auto const& grain : grains) writer.write(grain);
+  writer.flush();
+}
+
+std::vector<GrainOfSand> readGrains(std::string const& path) {
+  uint64_t count = countGrains(path);
+  std::vector<GrainOfSand> grains(count);
+  SandReader reader(path, 0, count, count);
+  for (auto& grain : grains) reader.next(grain);
+  return grains;
+}
+
+#endif  // SRC_SANDSTORAGE_H_
@@ -53,6 +53,55 @@ void testCase5(Adventure &adventure) {
   correctnessTest(eggs, BottomlessBag(2000), 12079, adventure);
 }
 
+void testCase6(Adventure &adventure) {
+  std::vector<Egg> eggs;
+  for (int i = 0; i < 33; ++i) {
+    eggs.push_back(Egg(i, i * i + 7));
+  }
+
+  Cancellation running;
+  BottomlessBag bag(100);
+  uint64_t packed = 0;
+  assert_msg(adventure.packEggs(eggs, bag, running, packed) == Status::OK,
+             "Unexpected packing status");
+  assert_eq_msg(packed, 2969, "Unexpected packing result");
+
+  Cancellation cancelled;
+  cancelled.cancel();
+  BottomlessBag untouched(100);
+  packed = 0;
+  assert_msg(adventure.packEggs(eggs, untouched, cancelled, packed) ==
+                 Status::CANCELLED,
+             "Cancelled packing not reported");
+  assert_eq_msg(packed, 0, "Cancelled packing has a result");
+  assert_eq_msg(untouched.getEggCount(), 0, "Cancelled packing filled the bag");
+
+  Cancellation expired(Cancellation::Clock::now());
+  assert_msg(adventure.packEggs(eggs, untouched, expired, packed) ==
+                 Status::DEADLINE_EXCEEDED,
+             "Expired packing not reported");
+  assert_eq_msg(untouched.getEggCount(), 0, "Expired packing filled the bag");
+}
+
+void testCase7(Adventure &adventure) {
+  std::vector<Egg> eggs1{Egg(1, 1), Egg(2, 2), Egg(3, 3)};
+  std::vector<Egg> eggs2;
+  for (int i = 0; i < 33; ++i) {
+    eggs2.push_back(Egg(i, i * i + 7));
+  }
+
+  std::vector<BottomlessBag> bags(8, BottomlessBag(100));
+  std::vector<std::future<uint64_t> > packings;
+  for (size_t i = 0; i < bags.size(); ++i) {
+    packings.push_back(
+        adventure.packEggsAsync(i % 2 ? eggs1 : eggs2, bags[i]));
+  }
+  for (size_t i = 0; i < packings.size(); ++i) {
+    assert_eq_msg(packings[i].get(), i % 2 ? 6 : 2969,
+                  "Unexpected asynchronous packing result");
+  }
+}
+
 int main(int argc, char **argv) {
   for (std::shared_ptr<Adventure> adventure :
        std::vector<std::shared_ptr<Adventure> >{
@@ -61,12 +110,26 @@ int main(int argc, char **argv) {
            std::shared_ptr<Adventure>(new TeamAdventure(2)),
            std::shared_ptr<Adventure>(new TeamAdventure(3)),
            std::shared_ptr<Adventure>(new TeamAdventure(4)),
-           std::shared_ptr<Adventure>(new TeamAdventure(8))}) {
+           std::shared_ptr<Adventure>(new TeamAdventure(8)),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(4)),
+           std::shared_ptr<Adventure>(new TeamAdventure(4, BorrowShamans())),
+           std::shared_ptr<Adventure>(
+               new StealingTeamAdventure(3, BorrowShamans())),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(4, PoolOptions(Pinning::SCATTER))),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(
+               3, PoolOptions(Pinning::EXPLICIT, {0}))),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(3, PoolOptions(IdlePolicy(1 << 10, 16)))),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(
+               3, PoolOptions(IdlePolicy(1 << 10, 16))))}) {
     if (argc == 1) {
       // runAndPrintDuration([&adventure]() {
       testCase1(*adventure);
       testCase2(*adventure);
       testCase3(*adventure);
+      testCase6(*adventure);
+      testCase7(*adventure);
       // });
     } else {
       // runAndPrintDuration([&adventure]() {
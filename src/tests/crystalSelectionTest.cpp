@@ -3,6 +3,10 @@
 #include <vector>
 
 #include "../adventure.h"
+#include "../adventurePipeline.h"
+#include "../crystalIndex.h"
+#include "../crystalKernels.h"
+#include "../crystalStream.h"
 #include "../utils.h"
 
 void runAndVerify(Adventure &adventure, std::vector<Crystal> &crystals,
@@ -33,6 +37,225 @@ void testCase1(Adventure &adventure) {
   runAndVerify(adventure, t5, r5);
 }
 
+void testCase2(Adventure &adventure) {
+  adventure.setVectorizedCrystals(true);
+  testCase1(adventure);
+
+  for (size_t n = 0; n < 40; ++n) {
+    std::vector<Crystal> t1(n);
+    for (size_t i = 0; i < n; ++i) {
+      t1[i] = Crystal((uint64_t(1) << 63) + (i * 7919) % 97);
+    }
+    Crystal r1 = n == 0 ? Crystal(0) : *std::max_element(t1.begin(), t1.end());
+    runAndVerify(adventure, t1, r1);
+  }
+
+#ifdef SHAMANS_X86_KERNELS
+  for (size_t n = 0; n < 40; ++n) {
+    std::vector<uint64_t> shininess(n);
+    for (auto &it : shininess) it = uint64_t(std::rand()) << (std::rand() % 40);
+    uint64_t expected = maxShininessScalar(shininess.data(), n);
+    if (__builtin_cpu_supports("avx2")) {
+      assert_eq_msg(maxShininessAvx2(shininess.data(), n), expected,
+                    "Wrong AVX2 crystal kernel");
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+      assert_eq_msg(maxShininessAvx512(shininess.data(), n), expected,
+                    "Wrong AVX-512 crystal kernel");
+    }
+  }
+#endif
+
+  std::vector<Crystal> t2(100003);
+  std::generate(t2.begin(), t2.end(), std::rand);
+  t2[77777] = Crystal(UINT64_MAX);
+  runAndVerify(adventure, t2, Crystal(UINT64_MAX));
+  adventure.setVectorizedCrystals(false);
+}
+
+void runBestAndVerify(Adventure &adventure, std::vector<Crystal> &crystals,
+                      size_t k) {
+  std::vector<size_t> expected(crystals.size());
+  for (size_t i = 0; i < expected.size(); ++i) expected[i] = i;
+  std::stable_sort(expected.begin(), expected.end(),
+                   [&crystals](size_t a, size_t b) {
+                     return crystals[b] < crystals[a];
+                   });
+  expected.resize(std::min(k, expected.size()));
+
+  std::vector<IndexedCrystal> best = adventure.selectBestCrystals(crystals, k);
+  assert_eq_msg(best.size(), expected.size(), "Wrong number of best crystals");
+  for (size_t i = 0; i < best.size(); ++i) {
+    assert_eq_msg(best[i].index, expected[i], "Wrong best crystal index");
+    assert_msg(best[i].crystal == crystals[expected[i]],
+               "Wrong best crystal");
+  }
+}
+
+void testCase3(Adventure &adventure) {
+  std::vector<Crystal> t1 = {Crystal(7), Crystal(7), Crystal(7), Crystal(1),
+                             Crystal(1), Crystal(4), Crystal(5)};
+  for (size_t k = 0; k <= t1.size() + 1; ++k) {
+    runBestAndVerify(adventure, t1, k);
+  }
+
+  std::vector<Crystal> t2(20000);
+  std::generate(t2.begin(), t2.end(), [] { return std::rand() % 1000; });
+  runBestAndVerify(adventure, t2, 1);
+  runBestAndVerify(adventure, t2, 100);
+
+  std::vector<Crystal> t3;
+  runBestAndVerify(adventure, t3, 3);
+}
+
+void runIndexAndVerify(Adventure &adventure, std::vector<Crystal> &crystals) {
+  size_t first = crystals.size(), last = crystals.size();
+  for (size_t i = 0; i < crystals.size(); ++i) {
+    if (first == crystals.size() || crystals[first] < crystals[i]) first = i;
+    if (last == crystals.size() || !(crystals[i] < crystals[last])) last = i;
+  }
+
+  IndexedCrystal best = adventure.selectBestCrystalIndex(crystals);
+  assert_eq_msg(best.index, first, "Wrong first best crystal index");
+  best = adventure.selectBestCrystalIndex(crystals, Occurrence::LAST);
+  assert_eq_msg(best.index, last, "Wrong last best crystal index");
+  if (last != crystals.size()) {
+    assert_msg(best.crystal == crystals[last], "Wrong best crystal");
+  }
+}
+
+void testCase4(Adventure &adventure) {
+  std::vector<Crystal> t1 = {Crystal(7), Crystal(7), Crystal(7), Crystal(1),
+                             Crystal(1), Crystal(4), Crystal(5)};
+  runIndexAndVerify(adventure, t1);
+  std::vector<Crystal> t2 = {Crystal(1), Crystal(9), Crystal(3), Crystal(9)};
+  runIndexAndVerify(adventure, t2);
+  std::vector<Crystal> t3;
+  runIndexAndVerify(adventure, t3);
+
+  std::vector<Crystal> t4(10007);
+  std::generate(t4.begin(), t4.end(), [] { return std::rand() % 100; });
+  runIndexAndVerify(adventure, t4);
+  adventure.setVectorizedCrystals(true);
+  runIndexAndVerify(adventure, t4);
+  adventure.setVectorizedCrystals(false);
+}
+
+Crystal bruteForceMax(std::vector<Crystal> &crystals, size_t lo, size_t hi) {
+  if (lo > hi || hi >= crystals.size()) return Crystal(0);
+  return *std::max_element(crystals.begin() + lo, crystals.begin() + hi + 1);
+}
+
+void testCase5(Adventure &adventure) {
+  std::vector<Crystal> t1(5000);
+  std::generate(t1.begin(), t1.end(), std::rand);
+  CrystalIndex index(adventure, t1);
+
+  std::vector<std::pair<size_t, size_t> > ranges;
+  for (int i = 0; i < 300; ++i) {
+    size_t lo = std::rand() % t1.size(), hi = std::rand() % t1.size();
+    ranges.push_back(std::make_pair(lo, hi));
+    ranges.push_back(std::make_pair(lo, lo + i % 40));
+
+    if (i % 10 == 0) {
+      size_t pos = std::rand() % t1.size();
+      t1[pos] = Crystal(std::rand());
+      index.update(pos, t1[pos]);
+    }
+    assert_msg(index.query(lo, hi) == bruteForceMax(t1, lo, hi),
+               "Wrong crystal range query");
+  }
+
+  std::vector<Crystal> batch = index.query(ranges);
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    assert_msg(batch[i] == bruteForceMax(t1, ranges[i].first, ranges[i].second),
+               "Wrong batched crystal range query");
+  }
+
+  std::vector<Crystal> t2;
+  CrystalIndex emptyIndex(adventure, t2);
+  assert_msg(emptyIndex.query(0, 0) == Crystal(0), "Wrong empty range query");
+}
+
+void testCase6(Adventure &adventure) {
+  std::vector<Crystal> t1(30000);
+  std::generate(t1.begin(), t1.end(), std::rand);
+  Crystal r1 = *std::max_element(t1.begin(), t1.end());
+
+  CrystalStream stream(adventure, 3);
+  size_t produced = 0;
+  stream.consume([&t1, &produced](std::vector<Crystal> &chunk) {
+    if (produced == t1.size()) return false;
+    size_t end = std::min(produced + 1000 + std::rand() % 1000, t1.size());
+    chunk.assign(t1.begin() + produced, t1.begin() + end);
+    produced = end;
+    return true;
+  });
+  assert_msg(stream.bestCrystal() == r1, "Wrong streamed crystal selection");
+
+  stream.push({});
+  stream.push({Crystal(UINT64_MAX)});
+  assert_msg(stream.bestCrystal() == Crystal(UINT64_MAX),
+             "Wrong streamed crystal selection");
+
+  CrystalStream emptyStream(adventure, 1);
+  assert_msg(emptyStream.bestCrystal() == Crystal(0),
+             "Wrong empty streamed crystal selection");
+}
+
+void testCase7(Adventure &adventure) {
+  std::vector<Crystal> t1(30000);
+  std::generate(t1.begin(), t1.end(), std::rand);
+  Crystal r1 = *std::max_element(t1.begin(), t1.end());
+  std::vector<GrainOfSand> t2(30000);
+  std::generate(t2.begin(), t2.end(), std::rand);
+  std::vector<GrainOfSand> r2 = t2;
+  std::sort(r2.begin(), r2.end());
+  std::vector<Egg> eggs{Egg(1, 1), Egg(2, 2), Egg(3, 3)};
+  BottomlessBag bag(5);
+
+  // a crystal search, a sort and a knapsack in flight at once
+  std::future<Crystal> crystal = adventure.selectBestCrystalAsync(t1);
+  std::future<void> arrangement = adventure.arrangeSandAsync(t2);
+  std::future<uint64_t> packing = adventure.packEggsAsync(eggs, bag);
+  assert_msg(crystal.get() == r1, "Wrong asynchronous crystal selection");
+  arrangement.get();
+  assert_msg(t2 == r2, "Wrong asynchronous sand arrangement");
+  assert_eq_msg(packing.get(), 5, "Unexpected asynchronous packing result");
+}
+
+template <class Pipeline>
+void testCase8() {
+  std::vector<Egg> eggs{Egg(1, 1), Egg(2, 2), Egg(3, 3)};
+  std::vector<Expedition> expeditions;
+  for (uint64_t i = 0; i < 12; ++i) {
+    std::vector<GrainOfSand> grains(std::rand() % 5000);
+    std::generate(grains.begin(), grains.end(), std::rand);
+    std::vector<Crystal> crystals(1 + std::rand() % 5000);
+    std::generate(crystals.begin(), crystals.end(), std::rand);
+    expeditions.push_back(
+        Expedition(eggs, BottomlessBag(i % 8), grains, crystals));
+  }
+
+  Pipeline pipeline(4, 2);
+  std::vector<std::future<Expedition> > results;
+  for (auto &expedition : expeditions) {
+    results.push_back(pipeline.submit(expedition));
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    Expedition result = results[i].get();
+    std::vector<GrainOfSand> grains = expeditions[i].grains;
+    std::sort(grains.begin(), grains.end());
+    assert_eq_msg(result.packedWeight, std::min<uint64_t>(i % 8, 6),
+                  "Unexpected pipeline packing result");
+    assert_msg(result.grains == grains, "Wrong pipeline sand arrangement");
+    assert_msg(result.bestCrystal ==
+                   *std::max_element(expeditions[i].crystals.begin(),
+                                     expeditions[i].crystals.end()),
+               "Wrong pipeline crystal selection");
+  }
+}
+
 int main(int argc, char **argv) {
   for (std::shared_ptr<Adventure> adventure :
        std::vector<std::shared_ptr<Adventure> >{
@@ -41,10 +264,20 @@ int main(int argc, char **argv) {
            std::shared_ptr<Adventure>(new TeamAdventure(2)),
            std::shared_ptr<Adventure>(new TeamAdventure(3)),
            std::shared_ptr<Adventure>(new TeamAdventure(4)),
-           std::shared_ptr<Adventure>(new TeamAdventure(8))}) {
+           std::shared_ptr<Adventure>(new TeamAdventure(8)),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(4)),
+           std::shared_ptr<Adventure>(new TeamAdventure(4, BorrowShamans())),
+           std::shared_ptr<Adventure>(
+               new StealingTeamAdventure(3, BorrowShamans()))}) {
     if (argc == 1) {
       // runAndPrintDuration([&adventure]() {
       testCase1(*adventure);
+      testCase2(*adventure);
+      testCase3(*adventure);
+      testCase4(*adventure);
+      testCase5(*adventure);
+      testCase6(*adventure);
+      testCase7(*adventure);
       // });
     } else {
       std::vector<Crystal> t2(2575757);
@@ -64,6 +297,10 @@ int main(int argc, char **argv) {
       // });
     }
   }
+  if (argc == 1) {
+    testCase8<AdventurePipeline>();
+    testCase8<StealingAdventurePipeline>();
+  }
 
   return 0;
 }
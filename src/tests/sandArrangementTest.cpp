@@ -1,6 +1,9 @@
+#include <cstdio>
+#include <string>
 #include <vector>
 
 #include "../adventure.h"
+#include "../sandStorage.h"
 #include "../utils.h"
 
 void runAndVerify(Adventure &adventure, std::vector<GrainOfSand> &grains,
@@ -29,6 +32,283 @@ void testCase1(Adventure &adventure) {
   runAndVerify(adventure, t3, r3);
 }
 
+void runFrugallyAndVerify(Adventure &adventure,
+                          std::vector<GrainOfSand> &grains,
+                          std::vector<GrainOfSand> &result) {
+  uint64_t comparisons = adventure.arrangeSandFrugally(grains);
+  assert_msg(grains == result, "Wrong frugal sand arrangement");
+  assert_msg(comparisons <= log2Factorial(grains.size()) + grains.size(),
+             "Too many comparisons in frugal sand arrangement");
+}
+
+void testCase2(Adventure &adventure) {
+  std::vector<GrainOfSand> t1 = {};
+  std::vector<GrainOfSand> r1 = {};
+  runFrugallyAndVerify(adventure, t1, r1);
+  std::vector<GrainOfSand> t2 = {GrainOfSand(7), GrainOfSand(7), GrainOfSand(7),
+                                 GrainOfSand(1), GrainOfSand(1), GrainOfSand(4),
+                                 GrainOfSand(5)};
+  std::vector<GrainOfSand> r2 = {GrainOfSand(1), GrainOfSand(1), GrainOfSand(4),
+                                 GrainOfSand(5), GrainOfSand(7), GrainOfSand(7),
+                                 GrainOfSand(7)};
+  runFrugallyAndVerify(adventure, t2, r2);
+
+  std::vector<GrainOfSand> t3(1000);
+  std::generate(t3.begin(), t3.end(), std::rand);
+  std::vector<GrainOfSand> r3 = t3;
+  std::sort(r3.begin(), r3.end());
+  runFrugallyAndVerify(adventure, t3, r3);
+
+  std::vector<GrainOfSand> t4(1000);
+  for (size_t i = 0; i < t4.size(); ++i) t4[i] = GrainOfSand(i % 100);
+  std::vector<GrainOfSand> r4 = t4;
+  std::sort(r4.begin(), r4.end());
+  runFrugallyAndVerify(adventure, t4, r4);
+}
+
+void testCase3(Adventure &adventure) {
+  std::vector<GrainOfSand> t1 = {};
+  adventure.arrangeSand(t1);
+  assert_msg(t1.empty(), "Wrong empty sand arrangement");
+
+  std::vector<GrainOfSand> t2(3000);
+  std::generate(t2.begin(), t2.end(), std::rand);
+  std::vector<GrainOfSand> r2 = t2;
+  std::sort(r2.begin(), r2.end());
+  for (uint64_t seed : {0ULL, 1ULL, 0xdeadbeefULL}) {
+    std::vector<GrainOfSand> grains = t2;
+    adventure.arrangeSandSeeded(grains, seed);
+    assert_msg(grains == r2, "Wrong seeded sand arrangement");
+  }
+
+  // A sort stopped early leaves a permutation that depends on its pivots:
+  // the same one for the same seed, another one for another seed.
+  std::vector<GrainOfSand> t3(40000);
+  std::generate(t3.begin(), t3.end(), std::rand);
+  std::vector<std::vector<GrainOfSand> > stopped;
+  for (uint64_t seed : {5ULL, 5ULL, 6ULL}) {
+    std::vector<GrainOfSand> grains = t3;
+    Cancellation afterTwoChecks(uint64_t(2));
+    assert_msg(adventure.arrangeSandSeeded(grains, seed, afterTwoChecks) ==
+                   Status::CANCELLED,
+               "Stopped seeded sand arrangement not reported");
+    stopped.push_back(grains);
+  }
+  assert_msg(stopped[0] == stopped[1],
+             "Seeded sand arrangement not reproducible");
+  assert_msg(stopped[0] != stopped[2],
+             "Seeded sand arrangement ignores the seed");
+}
+
+void runExternallyAndVerify(Adventure &adventure,
+                            std::vector<GrainOfSand> &grains,
+                            size_t memoryBudget) {
+  std::string inputPath = "sandArrangementTest.in";
+  std::string outputPath = "sandArrangementTest.out";
+  writeGrains(inputPath, grains);
+  adventure.arrangeSandExternally(inputPath, outputPath, memoryBudget);
+
+  std::vector<GrainOfSand> result = grains;
+  std::sort(result.begin(), result.end());
+  assert_msg(readGrains(outputPath) == result,
+             "Wrong external sand arrangement");
+  assert_msg(std::fopen((outputPath + ".run0").c_str(), "rb") == nullptr,
+             "Sand runs left behind");
+  std::remove(inputPath.c_str());
+  std::remove(outputPath.c_str());
+}
+
+void testCase4(Adventure &adventure) {
+  std::vector<GrainOfSand> t1 = {};
+  runExternallyAndVerify(adventure, t1, 1024);
+
+  std::vector<GrainOfSand> t2(5000);
+  std::generate(t2.begin(), t2.end(), std::rand);
+  runExternallyAndVerify(adventure, t2, 8 * 1000);
+  runExternallyAndVerify(adventure, t2, 8 * 5000);
+
+  std::vector<GrainOfSand> t3(3000);
+  for (size_t i = 0; i < t3.size(); ++i) t3[i] = GrainOfSand(i % 7);
+  runExternallyAndVerify(adventure, t3, 8 * 700);
+}
+
+void testCase5(Adventure &adventure) {
+  std::vector<GrainOfSand> t1(40000);
+  std::generate(t1.begin(), t1.end(), std::rand);
+  std::vector<GrainOfSand> r1 = t1;
+  std::sort(r1.begin(), r1.end());
+
+  for (size_t n : {size_t(0), size_t(777), r1.size() / 2, r1.size() - 1}) {
+    std::vector<GrainOfSand> grains = t1;
+    assert_msg(adventure.selectNth(grains, n) == r1[n], "Wrong nth grain");
+    assert_msg(grains[n] == r1[n], "Wrong nth grain position");
+  }
+
+  std::vector<GrainOfSand> grains = t1;
+  adventure.partialArrange(grains, 100);
+  assert_msg(std::equal(r1.begin(), r1.begin() + 100, grains.begin()),
+             "Wrong partial sand arrangement");
+
+  grains = t1;
+  std::vector<GrainOfSand> quantiles =
+      adventure.percentiles(grains, {0.5, 0.0, 1.0, 0.99, 0.5});
+  assert_msg(quantiles == std::vector<GrainOfSand>{r1[20000], r1[0],
+                                                   r1.back(), r1[39599],
+                                                   r1[20000]},
+             "Wrong sand percentiles");
+}
+
+void testCase6(Adventure &adventure) {
+  std::vector<GrainOfSand> arranged;
+  std::vector<GrainOfSand> all;
+  for (size_t batchSize : {0, 1, 5000, 37, 0, 1000}) {
+    std::vector<GrainOfSand> batch(batchSize);
+    std::generate(batch.begin(), batch.end(), [] { return std::rand() % 500; });
+    all.insert(all.end(), batch.begin(), batch.end());
+    adventure.arrangeSandIncremental(arranged, batch);
+
+    std::vector<GrainOfSand> result = all;
+    std::sort(result.begin(), result.end());
+    assert_msg(arranged == result, "Wrong incremental sand arrangement");
+  }
+}
+
+void testCase7(Adventure &adventure) {
+  std::vector<GrainOfSand> t1(20000);
+  std::generate(t1.begin(), t1.end(), [] { return std::rand() % 10; });
+  std::vector<GrainOfSand> r1 = t1;
+  std::sort(r1.begin(), r1.end());
+  runAndVerify(adventure, t1, r1);
+
+  std::vector<GrainOfSand> t2(20000);
+  for (size_t i = 0; i < t2.size(); ++i) {
+    t2[i] = GrainOfSand(i % 1000 == 0 ? std::rand() : 4);
+  }
+  std::vector<GrainOfSand> r2 = t2;
+  std::sort(r2.begin(), r2.end());
+  runAndVerify(adventure, t2, r2);
+}
+
+void testCase8(Adventure &adventure) {
+  std::vector<GrainOfSand> t1(30000);
+  std::generate(t1.begin(), t1.end(), std::rand);
+  std::vector<GrainOfSand> r1 = t1;
+  std::sort(r1.begin(), r1.end());
+
+  std::vector<GrainOfSand> grains = t1;
+  {
+    ArrangedSandView view(adventure, grains);
+    for (size_t i = 0; i < 100; ++i) {
+      assert_msg(view[i] == r1[i], "Wrong lazily arranged grain");
+    }
+  }
+
+  grains = t1;
+  ArrangedSandView view(adventure, grains, 7);
+  size_t pos = 0;
+  for (GrainOfSand const &grain : view) {
+    assert_msg(grain == r1[pos++], "Wrong lazily arranged grain");
+  }
+  assert_msg(grains == r1, "Wrong lazy sand arrangement");
+
+  std::vector<GrainOfSand> t2 = {};
+  ArrangedSandView emptyView(adventure, t2);
+  assert_msg(!(emptyView.begin() != emptyView.end()), "Wrong empty view");
+}
+
+void testCase9(Adventure &adventure) {
+  std::vector<std::vector<GrainOfSand> > deserts(1500);
+  for (auto &desert : deserts) {
+    desert.resize(std::rand() % 300);
+    std::generate(desert.begin(), desert.end(), std::rand);
+  }
+  deserts[42].resize(20000);
+  std::generate(deserts[42].begin(), deserts[42].end(), std::rand);
+
+  std::vector<std::vector<GrainOfSand> > results = deserts;
+  for (auto &result : results) std::sort(result.begin(), result.end());
+  adventure.arrangeSandBatch(deserts);
+  assert_msg(deserts == results, "Wrong batch sand arrangement");
+}
+
+void testCase10(Adventure &adventure) {
+  std::vector<GrainOfSand> t1(20000);
+  std::generate(t1.begin(), t1.end(), std::rand);
+  std::vector<GrainOfSand> r1 = t1;
+  std::sort(r1.begin(), r1.end());
+
+  std::vector<GrainOfSand> grains = t1;
+  Cancellation running;
+  assert_msg(adventure.arrangeSand(grains, running) == Status::OK,
+             "Unexpected sand arrangement status");
+  assert_msg(grains == r1, "Wrong cancellable sand arrangement");
+
+  grains = t1;
+  Cancellation cancelled;
+  cancelled.cancel();
+  assert_msg(adventure.arrangeSand(grains, cancelled) == Status::CANCELLED,
+             "Cancelled sand arrangement not reported");
+  std::sort(grains.begin(), grains.end());
+  assert_msg(grains == r1, "Cancelled sand arrangement lost grains");
+
+  grains = t1;
+  Cancellation expired(Cancellation::Clock::now());
+  assert_msg(adventure.arrangeSandSeeded(grains, 7, expired) ==
+                 Status::DEADLINE_EXCEEDED,
+             "Expired sand arrangement not reported");
+}
+
+void testCase11(Adventure &adventure) {
+  std::vector<std::vector<GrainOfSand> > deserts(6);
+  for (auto &desert : deserts) {
+    desert.resize(std::rand() % 8000);
+    std::generate(desert.begin(), desert.end(), std::rand);
+  }
+  std::vector<std::vector<GrainOfSand> > results = deserts;
+  for (auto &result : results) std::sort(result.begin(), result.end());
+
+  std::vector<std::future<void> > arrangements;
+  for (auto &desert : deserts) {
+    arrangements.push_back(adventure.arrangeSandAsync(desert));
+  }
+  for (auto &arrangement : arrangements) arrangement.get();
+  assert_msg(deserts == results, "Wrong asynchronous sand arrangement");
+}
+
+// Selection on a desert of almost a single size takes about as many
+// comparisons as a few scans of it, not one scan per grain.
+void testCase12(Adventure &adventure) {
+  std::vector<GrainOfSand> t1(20000);
+  for (size_t i = 0; i < t1.size(); ++i) {
+    t1[i] = GrainOfSand(i % 1000 == 0 ? std::rand() : 4);
+  }
+  std::vector<GrainOfSand> r1 = t1;
+  std::sort(r1.begin(), r1.end());
+
+  auto startTime = getCurrentTime();
+  size_t smaller = std::count_if(
+      t1.begin(), t1.end(),
+      [&r1](GrainOfSand const &grain) { return grain < r1[10000]; });
+  double scanMillis = getTimeDifference(startTime);
+  assert_msg(smaller == 0, "Wrong count of smaller grains");
+
+  startTime = getCurrentTime();
+  std::vector<GrainOfSand> grains = t1;
+  assert_msg(adventure.selectNth(grains, 10000) == r1[10000],
+             "Wrong nth grain of one size");
+  grains = t1;
+  adventure.partialArrange(grains, 100);
+  assert_msg(std::equal(r1.begin(), r1.begin() + 100, grains.begin()),
+             "Wrong partial arrangement of one size");
+  grains = t1;
+  assert_msg(adventure.percentiles(grains, {0.0, 0.5, 1.0}) ==
+                 std::vector<GrainOfSand>{r1[0], r1[10000], r1.back()},
+             "Wrong percentiles of one size");
+  double selectMillis = getTimeDifference(startTime);
+  assert_msg(selectMillis < 100 * scanMillis + 10,
+             "Selection on one size is not linear");
+}
+
 int main(int argc, char **argv) {
   for (std::shared_ptr<Adventure> adventure :
        std::vector<std::shared_ptr<Adventure> >{
@@ -37,10 +317,33 @@ int main(int argc, char **argv) {
            std::shared_ptr<Adventure>(new TeamAdventure(2)),
            std::shared_ptr<Adventure>(new TeamAdventure(3)),
            std::shared_ptr<Adventure>(new TeamAdventure(4)),
-           std::shared_ptr<Adventure>(new TeamAdventure(8))}) {
+           std::shared_ptr<Adventure>(new TeamAdventure(8)),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(4)),
+           std::shared_ptr<Adventure>(new TeamAdventure(4, BorrowShamans())),
+           std::shared_ptr<Adventure>(
+               new StealingTeamAdventure(3, BorrowShamans())),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(4, PoolOptions(Pinning::SCATTER))),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(
+               3, PoolOptions(Pinning::EXPLICIT, {0}))),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(3, PoolOptions(IdlePolicy(1 << 10, 16)))),
+           std::shared_ptr<Adventure>(new StealingTeamAdventure(
+               3, PoolOptions(IdlePolicy(1 << 10, 16))))}) {
     if (argc == 1) {
       // runAndPrintDuration([&adventure]() {
       testCase1(*adventure);
+      testCase2(*adventure);
+      testCase3(*adventure);
+      testCase4(*adventure);
+      testCase5(*adventure);
+      testCase6(*adventure);
+      testCase7(*adventure);
+      testCase8(*adventure);
+      testCase9(*adventure);
+      testCase10(*adventure);
+      testCase11(*adventure);
+      testCase12(*adventure);
       //});
     } else {
       std::vector<GrainOfSand> t2(50000);
@@ -34,6 +34,8 @@ class GrainOfSand {
 
   GrainOfSand(uint64_t sizeArg) : size(sizeArg) {}  //  NOLINT
 
+  uint64_t getSize() const { return this->size; }
+
   bool operator<(GrainOfSand const& other) const {
     burden(this->size, other.size);
     return this->size < other.size;
@@ -81,6 +83,7 @@ class BottomlessBag {
   explicit BottomlessBag(uint64_t capacityArg) : capacity(capacityArg) {}
 
   uint64_t getCapacity() { return this->capacity; }
+  size_t getEggCount() const { return this->eggs.size(); }
 
   void addEgg(Egg const& egg) { this->eggs.push_back(egg); }
 
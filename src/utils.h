@@ -2,6 +2,7 @@
 #define SRC_UTILS_H_
 
 #include <chrono>
+#include <cmath>
 #include <iostream>
 
 void assert_msg(bool condition, std::string const& msg) {
@@ -30,6 +31,12 @@ double getTimeDifference(
       .count();
 }
 
+// Information-theoretic lower bound on the comparisons needed to sort n
+// distinct elements.
+double log2Factorial(uint64_t n) {
+  return std::lgamma(n + 1.0) / std::log(2.0);
+}
+
 template <class F>
 void runAndPrintDuration(F&& lambda) {
   auto startTime = getCurrentTime();
@@ -0,0 +1,273 @@
+#ifndef THREAD_POOL_AFFINITY_H
+#define THREAD_POOL_AFFINITY_H
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// How the workers of a pool are placed on CPUs.
+enum class Pinning {
+  // left to the OS scheduler
+  NONE,
+  // fill the cores of one NUMA node before moving to the next
+  COMPACT,
+  // spread over the NUMA nodes first, then over the cores of each node
+  SCATTER,
+  // worker i runs on cpus[i % cpus.size()]
+  EXPLICIT
+};
+
+// The CPUs this process may run on and where they sit in the machine, as
+// reported by /sys. Without that information every CPU is its own core on
+// NUMA node 0.
+class CpuTopology {
+ public:
+  struct Cpu {
+    int id;
+    int node;
+    int package;
+    int core;
+  };
+
+  CpuTopology() {
+    std::map<int, int> nodes;
+    for (int node : readList("/sys/devices/system/node/online")) {
+      std::ostringstream path;
+      path << "/sys/devices/system/node/node" << node << "/cpulist";
+      for (int cpu : readList(path.str())) nodes[cpu] = node;
+    }
+
+    std::vector<int> online = readList("/sys/devices/system/cpu/online");
+    for (int cpu : online) {
+      if (!allowed(cpu)) continue;
+      std::ostringstream topology;
+      topology << "/sys/devices/system/cpu/cpu" << cpu << "/topology/";
+      Cpu info = {cpu, nodes.count(cpu) ? nodes[cpu] : 0,
+                  readInt(topology.str() + "physical_package_id", 0),
+                  readInt(topology.str() + "core_id", cpu)};
+      available.push_back(info);
+    }
+    std::sort(available.begin(), available.end(), [](Cpu a, Cpu b) {
+      return std::make_tuple(a.node, a.package, a.core, a.id) <
+             std::make_tuple(b.node, b.package, b.core, b.id);
+    });
+  }
+
+  static CpuTopology const& machine() {
+    static CpuTopology topology;
+    return topology;
+  }
+
+  // Node by node, and hyperthreads of a core next to each other.
+  std::vector<int> compactOrder() const {
+    std::vector<int> order;
+    for (Cpu const& cpu : available) order.push_back(cpu.id);
+    return order;
+  }
+
+  // One CPU per node in turn; within a node every core gets a CPU before
+  // any core gets a second one.
+  std::vector<int> scatterOrder() const {
+    std::map<int, std::vector<std::pair<size_t, Cpu> > > byNode;
+    for (size_t i = 0; i < available.size(); ++i) {
+      Cpu const& cpu = available[i];
+      // earlier hyperthreads of the same core, which sort right before it
+      size_t sibling = 0;
+      for (size_t j = i; j > 0 && sameCore(available[j - 1], cpu); --j) {
+        ++sibling;
+      }
+      byNode[cpu.node].push_back(std::make_pair(sibling, cpu));
+    }
+
+    std::vector<std::vector<int> > nodeOrders;
+    for (auto& it : byNode) {
+      std::stable_sort(
+          it.second.begin(), it.second.end(),
+          [](std::pair<size_t, Cpu> const& a, std::pair<size_t, Cpu> const& b) {
+            return a.first < b.first;
+          });
+      nodeOrders.push_back(std::vector<int>());
+      for (auto const& cpu : it.second) {
+        nodeOrders.back().push_back(cpu.second.id);
+      }
+    }
+
+    std::vector<int> order;
+    for (size_t round = 0; order.size() < available.size(); ++round) {
+      for (auto const& nodeOrder : nodeOrders) {
+        if (round < nodeOrder.size()) order.push_back(nodeOrder[round]);
+      }
+    }
+    return order;
+  }
+
+  // Only the CPUs the process may run on, in the given order.
+  std::vector<int> filter(std::vector<int> const& cpus) const {
+    std::vector<int> usable;
+    for (int cpu : cpus) {
+      if (nodeOf(cpu) >= 0) usable.push_back(cpu);
+    }
+    return usable;
+  }
+
+  // -1 for a CPU the process may not run on.
+  int nodeOf(int cpu) const {
+    for (Cpu const& it : available) {
+      if (it.id == cpu) return it.node;
+    }
+    return -1;
+  }
+
+ private:
+  std::vector<Cpu> available;
+
+  static bool sameCore(Cpu const& a, Cpu const& b) {
+    return a.node == b.node && a.package == b.package && a.core == b.core;
+  }
+
+  static bool allowed(int cpu) {
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0) return true;
+    return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &mask);
+#else
+    return cpu >= 0;
+#endif
+  }
+
+  static int readInt(std::string const& path, int fallback) {
+    std::ifstream file(path);
+    int value = fallback;
+    if (!(file >> value)) return fallback;
+    return value;
+  }
+
+  // Parses lists such as "0-3,8,10-11"; a missing file reads as "0".
+  static std::vector<int> readList(std::string const& path) {
+    std::ifstream file(path);
+    std::string text;
+    if (!std::getline(file, text)) text = "0";
+
+    std::vector<int> values;
+    std::istringstream ranges(text);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+      int first = 0, last = 0;
+      char dash = 0;
+      std::istringstream bounds(range);
+      if (!(bounds >> first)) continue;
+      last = first;
+      if (bounds >> dash >> last && dash != '-') last = first;
+      for (int value = first; value <= last; ++value) values.push_back(value);
+    }
+    return values;
+  }
+};
+
+// Where the workers of one pool run. Nodes are numbered densely from 0 over
+// the nodes the workers are pinned to; unpinned workers all count as node 0.
+class WorkerPlacement {
+ public:
+  WorkerPlacement(size_t workers, Pinning pinning,
+                  std::vector<int> const& explicitCpus)
+      : cpus(workers, -1), nodes(workers, 0), nodeWorkers(1, workers) {
+    CpuTopology const& topology = CpuTopology::machine();
+    std::vector<int> order;
+    switch (pinning) {
+      case Pinning::NONE:
+        break;
+      case Pinning::COMPACT:
+        order = topology.compactOrder();
+        break;
+      case Pinning::SCATTER:
+        order = topology.scatterOrder();
+        break;
+      case Pinning::EXPLICIT:
+        order = topology.filter(explicitCpus);
+        break;
+    }
+    if (order.empty() || workers == 0) return;
+
+    std::map<int, int> denseNodes;
+    nodeWorkers.clear();
+    for (size_t worker = 0; worker < workers; ++worker) {
+      cpus[worker] = order[worker % order.size()];
+      int node = topology.nodeOf(cpus[worker]);
+      if (!denseNodes.count(node)) {
+        int dense = static_cast<int>(denseNodes.size());
+        denseNodes[node] = dense;
+        nodeWorkers.push_back(0);
+      }
+      nodes[worker] = denseNodes[node];
+      ++nodeWorkers[nodes[worker]];
+    }
+  }
+
+  // Pins the calling thread to the CPU of worker. Pinning is best effort:
+  // the thread keeps running unpinned if the OS refuses.
+  void pin(size_t worker) const {
+#ifdef __linux__
+    if (cpus[worker] < 0 || cpus[worker] >= CPU_SETSIZE) return;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpus[worker], &mask);
+    pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+#endif
+  }
+
+  int cpuOf(size_t worker) const { return cpus[worker]; }
+  int nodeOf(size_t worker) const { return nodes[worker]; }
+  size_t nodeCount() const { return nodeWorkers.size(); }
+  size_t workersOn(size_t node) const { return nodeWorkers[node]; }
+
+ private:
+  std::vector<int> cpus;
+  std::vector<int> nodes;
+  std::vector<size_t> nodeWorkers;
+};
+
+// Storage for count objects that is left untouched on allocation, so that
+// every page lands on the NUMA node of the thread that writes it first.
+// Elements must be written, or constructed in place, before they are read.
+template <class T>
+class FirstTouchBuffer {
+  static_assert(std::is_trivially_destructible<T>::value,
+                "FirstTouchBuffer never destroys its elements");
+
+ public:
+  explicit FirstTouchBuffer(size_t countArg)
+      : count(countArg),
+        items(static_cast<T*>(::operator new(countArg * sizeof(T)))) {}
+  FirstTouchBuffer(FirstTouchBuffer&& other)
+      : count(other.count), items(other.items) {
+    other.count = 0;
+    other.items = nullptr;
+  }
+  FirstTouchBuffer(FirstTouchBuffer const&) = delete;
+  FirstTouchBuffer& operator=(FirstTouchBuffer const&) = delete;
+  ~FirstTouchBuffer() { ::operator delete(items); }
+
+  T& operator[](size_t i) { return items[i]; }
+  T const& operator[](size_t i) const { return items[i]; }
+  T* data() { return items; }
+  size_t size() const { return count; }
+
+ private:
+  size_t count;
+  T* items;
+};
+
+#endif
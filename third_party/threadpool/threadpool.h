@@ -1,50 +1,721 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <future>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-class ThreadPool {
+#include "affinity.h"
+
+// Per-thread caches of freed blocks, one per size class of SIZE_CLASS
+// bytes, so that tasks, queue nodes and future states stop going through
+// malloc once a pool is warm. Blocks often die on another thread than the
+// one that allocated them, so caches hand surplus blocks to a shared depot
+// and refill from it, BATCH blocks at a time.
+class TaskSlab {
+ public:
+  static void* allocate(size_t bytes) {
+    size_t sizeClass = classOf(bytes);
+    if (sizeClass >= CLASSES) return ::operator new(bytes);
+
+    std::vector<void*>& blocks = cache().blocks[sizeClass];
+    if (blocks.empty()) transfer(depot().blocks[sizeClass], blocks);
+    if (blocks.empty()) return ::operator new((sizeClass + 1) * SIZE_CLASS);
+    void* block = blocks.back();
+    blocks.pop_back();
+    return block;
+  }
+
+  static void deallocate(void* block, size_t bytes) {
+    size_t sizeClass = classOf(bytes);
+    if (sizeClass >= CLASSES) {
+      ::operator delete(block);
+      return;
+    }
+
+    std::vector<void*>& blocks = cache().blocks[sizeClass];
+    blocks.push_back(block);
+    if (blocks.size() >= 2 * BATCH) transfer(blocks, depot().blocks[sizeClass]);
+  }
+
+ private:
+  static const size_t SIZE_CLASS = 64;
+  // up to the 512-byte nodes of std::deque
+  static const size_t CLASSES = 8;
+  static const size_t BATCH = 32;
+  static const size_t MAX_DEPOT = 64 * BATCH;
+
+  struct Blocks {
+    std::vector<void*> blocks[CLASSES];
+    ~Blocks() {
+      for (auto& it : blocks) {
+        for (void* block : it) ::operator delete(block);
+      }
+    }
+  };
+
+  static size_t classOf(size_t bytes) {
+    return (std::max<size_t>(bytes, 1) - 1) / SIZE_CLASS;
+  }
+  static Blocks& cache() {
+    static thread_local Blocks threadCache;
+    return threadCache;
+  }
+  // Never destroyed, as pools may still free blocks during static
+  // destruction.
+  static Blocks& depot() {
+    static Blocks* shared = new Blocks();
+    return *shared;
+  }
+  static std::mutex& depot_mutex() {
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  // Moves up to BATCH blocks; the depot frees what it cannot hold.
+  static void transfer(std::vector<void*>& from, std::vector<void*>& to) {
+    std::unique_lock<std::mutex> lock(depot_mutex());
+    for (size_t i = 0; i < BATCH && !from.empty(); ++i) {
+      if (to.size() < MAX_DEPOT) {
+        to.push_back(from.back());
+      } else {
+        ::operator delete(from.back());
+      }
+      from.pop_back();
+    }
+  }
+};
+
+// Allocator over TaskSlab, for task queues and the shared states of
+// futures.
+template <class T>
+struct SlabAllocator {
+  typedef T value_type;
+  SlabAllocator() {}
+  template <class U>
+  SlabAllocator(SlabAllocator<U> const&) {}
+  T* allocate(size_t n) {
+    return static_cast<T*>(TaskSlab::allocate(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) { TaskSlab::deallocate(p, n * sizeof(T)); }
+};
+template <class T, class U>
+bool operator==(SlabAllocator<T> const&, SlabAllocator<U> const&) {
+  return true;
+}
+template <class T, class U>
+bool operator!=(SlabAllocator<T> const&, SlabAllocator<U> const&) {
+  return false;
+}
+
+template <class T>
+using SlabQueue = std::queue<T, std::deque<T, SlabAllocator<T> > >;
+
+// Move-only void() callable. Callables of up to INLINE_BYTES are stored in
+// the task itself, larger ones in a TaskSlab block.
+class InlineTask {
+ public:
+  InlineTask() : ops(nullptr) {}
+  template <class F, class Target = typename std::decay<F>::type,
+            class = typename std::enable_if<
+                !std::is_same<Target, InlineTask>::value>::type>
+  InlineTask(F&& f) : ops(nullptr) {  // NOLINT(runtime/explicit)
+    emplace<Target>(std::forward<F>(f),
+                    std::integral_constant<bool, fitsInline<Target>()>());
+  }
+  InlineTask(InlineTask&& other) : ops(other.ops) {
+    if (ops) ops->move(other.storage, storage);
+    other.ops = nullptr;
+  }
+  InlineTask& operator=(InlineTask&& other) {
+    if (this != &other) {
+      reset();
+      ops = other.ops;
+      if (ops) ops->move(other.storage, storage);
+      other.ops = nullptr;
+    }
+    return *this;
+  }
+  InlineTask(InlineTask const&) = delete;
+  InlineTask& operator=(InlineTask const&) = delete;
+  ~InlineTask() { reset(); }
+
+  void operator()() { ops->invoke(storage); }
+  explicit operator bool() const { return ops != nullptr; }
+
+ private:
+  static const size_t INLINE_BYTES = 48;
+
+  struct Ops {
+    void (*invoke)(void*);
+    // move-constructs into the second storage and destroys the first
+    void (*move)(void*, void*);
+    void (*destroy)(void*);
+  };
+
+  template <class F>
+  struct Inline {
+    static void invoke(void* s) { (*static_cast<F*>(s))(); }
+    static void move(void* from, void* to) {
+      new (to) F(std::move(*static_cast<F*>(from)));
+      static_cast<F*>(from)->~F();
+    }
+    static void destroy(void* s) { static_cast<F*>(s)->~F(); }
+  };
+
+  template <class F>
+  struct Slab {
+    static F* target(void* s) { return *static_cast<F**>(s); }
+    static void invoke(void* s) { (*target(s))(); }
+    static void move(void* from, void* to) { new (to) F*(target(from)); }
+    static void destroy(void* s) {
+      target(s)->~F();
+      TaskSlab::deallocate(target(s), sizeof(F));
+    }
+  };
+
+  template <class F>
+  static constexpr bool fitsInline() {
+    return sizeof(F) <= INLINE_BYTES && alignof(F) <= 16 &&
+           std::is_nothrow_move_constructible<F>::value;
+  }
+
+  template <class Target, class F>
+  void emplace(F&& f, std::true_type) {
+    new (storage) Target(std::forward<F>(f));
+    static const Ops table = {&Inline<Target>::invoke, &Inline<Target>::move,
+                              &Inline<Target>::destroy};
+    ops = &table;
+  }
+
+  template <class Target, class F>
+  void emplace(F&& f, std::false_type) {
+    void* block = TaskSlab::allocate(sizeof(Target));
+    try {
+      new (storage) Target*(new (block) Target(std::forward<F>(f)));
+    } catch (...) {
+      TaskSlab::deallocate(block, sizeof(Target));
+      throw;
+    }
+    static const Ops table = {&Slab<Target>::invoke, &Slab<Target>::move,
+                              &Slab<Target>::destroy};
+    ops = &table;
+  }
+
+  void reset() {
+    if (ops) ops->destroy(storage);
+    ops = nullptr;
+  }
+
+  alignas(16) unsigned char storage[INLINE_BYTES];
+  Ops const* ops;
+};
+
+// Runs call and hands its result, or its exception, to promise.
+template <class R, class F>
+struct PromisedCall {
+  std::promise<R> promise;
+  F call;
+  void operator()() {
+    try {
+      promise.set_value(call());
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+    }
+  }
+};
+
+template <class F>
+struct PromisedCall<void, F> {
+  std::promise<void> promise;
+  F call;
+  void operator()() {
+    try {
+      call();
+      promise.set_value();
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+    }
+  }
+};
+
+// Wraps f(args...) into a task and returns the future of its result. The
+// shared state of the future lives in a TaskSlab block.
+template <class F, class... Args>
+auto promisedTask(InlineTask& task, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type> {
+  typedef typename std::result_of<F(Args...)>::type return_type;
+  typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...))
+      Call;
+
+  std::promise<return_type> promise(std::allocator_arg,
+                                    SlabAllocator<return_type>());
+  std::future<return_type> res = promise.get_future();
+  task = PromisedCall<return_type, Call>{
+      std::move(promise),
+      std::bind(std::forward<F>(f), std::forward<Args>(args)...)};
+  return res;
+}
+
+// How an idle thread of a pool waits for work: it polls spins times with
+// a pause in between, then yields its CPU yields times, and only then
+// parks. Spinning burns CPU time to avoid the wake-up latency of parking,
+// which matters when waits last microseconds.
+struct IdlePolicy {
+  IdlePolicy() : spins(0), yields(0) {}
+  IdlePolicy(size_t spinsArg, size_t yieldsArg)
+      : spins(spinsArg), yields(yieldsArg) {}
+
+  size_t spins;
+  size_t yields;
+};
+
+struct PoolOptions {
+  PoolOptions() : pinning(Pinning::NONE) {}
+  explicit PoolOptions(Pinning pinningArg,
+                       std::vector<int> cpusArg = std::vector<int>())
+      : pinning(pinningArg), cpus(cpusArg) {}
+  explicit PoolOptions(IdlePolicy idleArg)
+      : pinning(Pinning::NONE), idle(idleArg) {}
+
+  Pinning pinning;
+  // for Pinning::EXPLICIT
+  std::vector<int> cpus;
+  IdlePolicy idle;
+};
+
+// Waits until ready() holds, for at most the spinning and yielding phases
+// of policy. Returns whether ready() held.
+template <class Ready>
+bool spinUntil(IdlePolicy const& policy, Ready const& ready) {
+  for (size_t round = 0; round < policy.spins + policy.yields; ++round) {
+    if (ready()) return true;
+    if (round < policy.spins) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+      __builtin_ia32_pause();
+#endif
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  return ready();
+}
+
+// Blocks wait() until countDown() has been called count times. Only the
+// last countDown takes the lock. wait() returns only once that countDown
+// is done with the latch, so the latch may then be destroyed.
+class Latch {
  public:
-  ThreadPool(size_t);
+  explicit Latch(size_t count) : remaining(count), done(count == 0) {}
+  Latch(Latch const&) = delete;
+  Latch& operator=(Latch const&) = delete;
+
+  void countDown() {
+    if (--remaining == 0) {
+      std::unique_lock<std::mutex> lock(latch_mutex);
+      done = true;
+      released.notify_all();
+    }
+  }
+
+  // True once every countDown has been called; wait() may still block
+  // briefly after that.
+  bool tryWait() const { return remaining == 0; }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(latch_mutex);
+    released.wait(lock, [this] { return done; });
+  }
+
+ private:
+  std::atomic<size_t> remaining;
+  std::mutex latch_mutex;
+  std::condition_variable released;
+  bool done;
+};
+
+// Fork-join loops for a pool that provides enqueueBatch and
+// runPendingTask. The chunks of a loop are submitted as one batch and
+// joined through a single latch, and the first exception thrown by a chunk
+// is rethrown to the caller. Waiting threads help: they run pending tasks of
+// the pool until what they wait for is done, so loops and waits may nest
+// inside pool tasks at any depth. Also keeps where the workers of the pool
+// run; workers call startWorker before taking any task.
+template <class Pool>
+class ParallelAlgorithms {
+ public:
+  ParallelAlgorithms(size_t threads, PoolOptions const& options)
+      : idle(options.idle),
+        placement(threads, options.pinning, options.cpus),
+        nextOwner(0),
+        measuredTaskNanos(-1) {}
+
+  WorkerPlacement const& workerPlacement() const { return placement; }
+
+  // What a loop pays for every thread but the caller: queueing a task,
+  // waking a worker and joining it. Timed once per pool, on first use, with
+  // empty tasks the caller waits for instead of running them; it runs one
+  // itself only when the workers take too long, so a busy pool cannot stall
+  // the timing. Infinite for a pool without workers.
+  double taskNanos() {
+    double nanos = measuredTaskNanos.load(std::memory_order_relaxed);
+    if (nanos < 0) {
+      nanos = pool().size() == 0 ? std::numeric_limits<double>::infinity()
+                                 : timeTaskNanos();
+      measuredTaskNanos.store(nanos, std::memory_order_relaxed);
+    }
+    return nanos;
+  }
+
+  // Reserves count owners for the affine loops of one user of the pool and
+  // returns the first of them, so that users tag different workers.
+  size_t claimOwners(size_t count) {
+    return nextOwner.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  // Calls fn(chunkBegin, chunkEnd) on every chunk of grain indices of
+  // [begin, end); the last chunk may be shorter. At most concurrency
+  // threads, the calling one included, run chunks of the loop; each of them
+  // takes chunks until none are left.
+  template <class F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F const& fn,
+                    size_t concurrency = SIZE_MAX) {
+    if (begin >= end) return;
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = (end - begin + grain - 1) / grain;
+    size_t runners = std::min(chunks, std::max<size_t>(concurrency, 1));
+    if (runners == 1) {
+      for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += grain) {
+        fn(chunkBegin, std::min(chunkBegin + grain, end));
+      }
+      return;
+    }
+
+    // The chunks are dealt to the NUMA nodes of the workers in contiguous
+    // runs, in proportion to their workers. A task takes the next chunk of
+    // the node it runs on, or of the following nodes once that one has none
+    // left, so a chunk of data tends to stay on one node across loops.
+    size_t nodes = placement.nodeCount();
+    size_t workers = std::max<size_t>(pool().size(), 1);
+    std::vector<std::atomic<size_t> > nextChunk(nodes);
+    std::vector<size_t> endChunk(nodes);
+    size_t workersBefore = 0;
+    for (size_t node = 0; node < nodes; ++node) {
+      nextChunk[node] = chunks * workersBefore / workers;
+      workersBefore += placement.workersOn(node);
+      endChunk[node] = chunks * workersBefore / workers;
+    }
+    endChunk[nodes - 1] = chunks;
+
+    Join join(runners);
+    auto runChunks = [&] {
+      size_t home = onWorker() ? placement.nodeOf(currentWorker()) : 0;
+      for (size_t i = 0; i < nodes;) {
+        size_t node = (home + i) % nodes;
+        size_t chunk = nextChunk[node]++;
+        if (chunk >= endChunk[node]) {
+          ++i;
+          continue;
+        }
+        size_t chunkBegin = begin + chunk * grain;
+        join.run(fn, chunkBegin, std::min(chunkBegin + grain, end));
+      }
+      join.done();
+    };
+
+    std::vector<InlineTask> batch;
+    batch.reserve(runners - 1);
+    for (size_t runner = 1; runner < runners; ++runner) {
+      batch.emplace_back([&runChunks] { runChunks(); });
+    }
+    pool().enqueueBatch(batch);
+    runChunks();
+    join.wait(*this);
+  }
+
+  // Same as parallel_for, but chunk c > 0 is tagged for the
+  // (firstOwner + c - 1)-th worker, counting round the pool from the one
+  // after the calling worker and skipping it, or from worker 0 when the
+  // caller is not a worker. Loops with the same chunking from the same
+  // thread then run every chunk on the same worker, where its data is still
+  // cached; another thread takes a tagged chunk only when its worker falls
+  // behind. A loop with more chunks than concurrency runs as a plain
+  // parallel_for.
+  template <class F>
+  void parallel_for_affine(size_t begin, size_t end, size_t grain,
+                           F const& fn, size_t concurrency = SIZE_MAX,
+                           size_t firstOwner = 0) {
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = begin < end ? (end - begin + grain - 1) / grain : 0;
+    if (chunks <= 1 || chunks > concurrency || pool().size() == 0) {
+      parallel_for(begin, end, grain, fn, concurrency);
+      return;
+    }
+
+    Join join(chunks);
+    auto runChunk = [&](size_t chunk) {
+      size_t chunkBegin = begin + chunk * grain;
+      join.run(fn, chunkBegin, std::min(chunkBegin + grain, end));
+      join.done();
+    };
+
+    size_t workers = pool().size();
+    bool skipCaller = onWorker() && workers > 1;
+    size_t others = skipCaller ? workers - 1 : workers;
+    size_t start = skipCaller ? currentWorker() + 1 : 0;
+    std::vector<InlineTask> batch;
+    std::vector<size_t> owners;
+    batch.reserve(chunks - 1);
+    for (size_t chunk = 1; chunk < chunks; ++chunk) {
+      batch.emplace_back([&runChunk, chunk] { runChunk(chunk); });
+      owners.push_back((start + (firstOwner + chunk - 1) % others) % workers);
+    }
+    pool().enqueueBatch(batch, owners);
+    runChunk(0);
+    join.wait(*this);
+  }
+
+  // Folds map(chunkBegin, chunkEnd) over the chunks of parallel_for with
+  // combine, in chunk order and starting from identity.
+  template <class T, class Map, class Combine>
+  T parallel_reduce(size_t begin, size_t end, size_t grain, T identity,
+                    Map const& map, Combine const& combine,
+                    size_t concurrency = SIZE_MAX) {
+    if (begin >= end) return identity;
+    grain = std::max<size_t>(grain, 1);
+
+    // A cache line of padding on both sides keeps every partial result off
+    // the lines of its neighbours, whatever the size and alignment of T.
+    struct Partial {
+      explicit Partial(T const& valueArg) : front(), value(valueArg), back() {}
+      char front[CACHE_LINE];
+      T value;
+      char back[CACHE_LINE];
+    };
+    std::vector<Partial> partials((end - begin + grain - 1) / grain,
+                                  Partial(identity));
+    parallel_for(
+        begin, end, grain,
+        [&](size_t chunkBegin, size_t chunkEnd) {
+          partials[(chunkBegin - begin) / grain].value =
+              map(chunkBegin, chunkEnd);
+        },
+        concurrency);
+
+    T result = identity;
+    for (auto& it : partials) result = combine(result, it.value);
+    return result;
+  }
+
+  // Runs pending tasks until the latch is released. Once the pool has
+  // nothing pending, that is when the rest of the work is already running,
+  // waits as the idle policy says.
+  void waitHelping(Latch& latch) {
+    while (!latch.tryWait() && pool().runPendingTask()) {
+    }
+    spinUntil(idle, [&latch] { return latch.tryWait(); });
+    latch.wait();
+  }
+
+  template <class T>
+  void waitHelping(std::future<T> const& future) {
+    while (future.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready &&
+           pool().runPendingTask()) {
+    }
+    future.wait();
+  }
+
+ protected:
+  // Idle workers steal tagged tasks only from a worker with at least this
+  // many of them queued.
+  static const size_t STEAL_BACKLOG = 2;
+
+  IdlePolicy idle;
+  WorkerPlacement placement;
+  std::atomic<size_t> nextOwner;
+  // see taskNanos; negative until measured
+  std::atomic<double> measuredTaskNanos;
+
+  // The pool and worker index of the calling thread, if it is a worker.
+  static Pool*& currentPool() {
+    static thread_local Pool* pool = nullptr;
+    return pool;
+  }
+  static size_t& currentWorker() {
+    static thread_local size_t worker = 0;
+    return worker;
+  }
+  bool onWorker() { return currentPool() == &pool(); }
+
+  void startWorker(size_t worker) {
+    currentPool() = &pool();
+    currentWorker() = worker;
+    placement.pin(worker);
+  }
+
+ private:
+  static const size_t CACHE_LINE = 64;
+  static const size_t TASK_PROBES = 16;
+  static const size_t PROBE_PATIENCE_MICROS = 200;
+
+  // Completion of the runners of one loop, keeping the first exception.
+  class Join {
+   public:
+    explicit Join(size_t runners) : latch(runners) {}
+
+    template <class F>
+    void run(F const& fn, size_t chunkBegin, size_t chunkEnd) {
+      try {
+        fn(chunkBegin, chunkEnd);
+      } catch (...) {
+        std::unique_lock<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+      }
+    }
+
+    // Called by a runner once it takes no more chunks.
+    void done() { latch.countDown(); }
+
+    void wait(ParallelAlgorithms& algorithms) {
+      algorithms.waitHelping(latch);
+      if (error) std::rethrow_exception(error);
+    }
+
+   private:
+    Latch latch;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+  };
+
+  Pool& pool() { return static_cast<Pool&>(*this); }
+
+  // The fastest of TASK_PROBES round trips of an empty task.
+  double timeTaskNanos() {
+    double fastest = std::numeric_limits<double>::max();
+    for (size_t probe = 0; probe < TASK_PROBES; ++probe) {
+      auto start = std::chrono::steady_clock::now();
+      std::future<void> done = pool().enqueue([] {});
+      while (done.wait_for(std::chrono::microseconds(PROBE_PATIENCE_MICROS)) !=
+             std::future_status::ready) {
+        pool().runPendingTask();
+      }
+      fastest = std::min(fastest, std::chrono::duration<double, std::nano>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count());
+    }
+    return std::max(fastest, 1.0);
+  }
+};
+
+template <class Pool>
+const size_t ParallelAlgorithms<Pool>::PROBE_PATIENCE_MICROS;
+
+class ThreadPool : public ParallelAlgorithms<ThreadPool> {
+ public:
+  ThreadPool(size_t, PoolOptions const& options = PoolOptions());
   template <class F, class... Args>
   auto enqueue(F&& f, Args&&... args)
       -> std::future<typename std::result_of<F(Args...)>::type>;
+  // Fire and forget: queues f with no future to report its completion.
+  template <class F>
+  void submit(F&& f);
+  // Queues every task of batch under one lock and wakes all workers once.
+  void enqueueBatch(std::vector<InlineTask>& batch);
+  // Same, but batch[i] is tagged for worker owners[i] % size().
+  void enqueueBatch(std::vector<InlineTask>& batch,
+                    std::vector<size_t> const& owners);
+  // Runs a pending task on the calling thread, if there is one.
+  bool runPendingTask();
+  size_t size() const { return workers.size(); }
   ~ThreadPool();
 
  private:
   // need to keep track of threads so we can join them
   std::vector<std::thread> workers;
   // the task queue
-  std::queue<std::function<void()> > tasks;
+  SlabQueue<InlineTask> tasks;
+  // tasks tagged for one worker
+  std::vector<SlabQueue<InlineTask> > mailboxes;
+  // tasks in all queues, for idle workers to poll without the lock
+  std::atomic<size_t> queuedTasks;
 
   // synchronization
   std::mutex queue_mutex;
   std::condition_variable condition;
+  // parked workers; notifications are skipped while there are none
+  size_t sleepers;
   bool stop;
+
+  // Wakes parked workers, if any; called with queue_mutex held.
+  void wake(bool all) {
+    if (sleepers == 0) return;
+    if (all) {
+      condition.notify_all();
+    } else {
+      condition.notify_one();
+    }
+  }
+
+  // The queue worker should take its next task from: its own mailbox, the
+  // task queue, or the mailbox of a worker that has at least backlog tasks
+  // tagged for it. worker is size() for threads outside the pool. Called
+  // with queue_mutex held.
+  SlabQueue<InlineTask>* queueFor(size_t worker, size_t backlog) {
+    if (worker < mailboxes.size() && !mailboxes[worker].empty()) {
+      return &mailboxes[worker];
+    }
+    if (!tasks.empty()) return &tasks;
+    for (auto& mailbox : mailboxes) {
+      if (mailbox.size() >= backlog) return &mailbox;
+    }
+    return nullptr;
+  }
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
+inline ThreadPool::ThreadPool(size_t threads, PoolOptions const& options)
+    : ParallelAlgorithms<ThreadPool>(threads, options),
+      mailboxes(threads),
+      queuedTasks(0),
+      sleepers(0),
+      stop(false) {
   for (size_t i = 0; i < threads; ++i)
-    workers.emplace_back([this] {
+    workers.emplace_back([this, i] {
+      startWorker(i);
       for (;;) {
-        std::function<void()> task;
+        InlineTask task;
+        spinUntil(idle, [this] { return this->queuedTasks > 0; });
 
         {
           std::unique_lock<std::mutex> lock(this->queue_mutex);
-          this->condition.wait(
-              lock, [this] { return this->stop || !this->tasks.empty(); });
-          if (this->stop && this->tasks.empty()) return;
-          task = std::move(this->tasks.front());
-          this->tasks.pop();
+          SlabQueue<InlineTask>* queue = nullptr;
+          while ((queue = queueFor(i, STEAL_BACKLOG)) == nullptr &&
+                 !this->stop) {
+            ++this->sleepers;
+            this->condition.wait(lock);
+            --this->sleepers;
+          }
+          if (queue == nullptr) return;
+          task = std::move(queue->front());
+          queue->pop();
+          --this->queuedTasks;
         }
 
         task();
@@ -56,22 +727,72 @@ inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
 template <class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type> {
-  using return_type = typename std::result_of<F(Args...)>::type;
+  InlineTask task;
+  auto res =
+      promisedTask(task, std::forward<F>(f), std::forward<Args>(args)...);
+  submit(std::move(task));
+  return res;
+}
 
-  auto task = std::make_shared<std::packaged_task<return_type()> >(
-      std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+template <class F>
+void ThreadPool::submit(F&& f) {
+  InlineTask task(std::forward<F>(f));
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+
+    // don't allow enqueueing after stopping the pool
+    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
 
-  std::future<return_type> res = task->get_future();
+    tasks.push(std::move(task));
+    ++queuedTasks;
+    wake(false);
+  }
+}
+
+inline void ThreadPool::enqueueBatch(std::vector<InlineTask>& batch) {
   {
     std::unique_lock<std::mutex> lock(queue_mutex);
 
     // don't allow enqueueing after stopping the pool
     if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
 
-    tasks.emplace([task]() { (*task)(); });
+    for (auto& task : batch) tasks.push(std::move(task));
+    queuedTasks += batch.size();
+    wake(true);
   }
-  condition.notify_one();
-  return res;
+}
+
+inline void ThreadPool::enqueueBatch(std::vector<InlineTask>& batch,
+                                     std::vector<size_t> const& owners) {
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+
+    // don't allow enqueueing after stopping the pool
+    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+      mailboxes[owners[i] % mailboxes.size()].push(std::move(batch[i]));
+    }
+    queuedTasks += batch.size();
+    wake(true);
+  }
+}
+
+// A helping thread may take any tagged task: it would otherwise block on
+// work that is queued behind a busy worker.
+inline bool ThreadPool::runPendingTask() {
+  InlineTask task;
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    SlabQueue<InlineTask>* queue =
+        queueFor(onWorker() ? currentWorker() : mailboxes.size(), 1);
+    if (queue == nullptr) return false;
+    task = std::move(queue->front());
+    queue->pop();
+    --queuedTasks;
+  }
+  task();
+  return true;
 }
 
 // the destructor joins all threads
@@ -84,4 +805,467 @@ inline ThreadPool::~ThreadPool() {
   for (std::thread& worker : workers) worker.join();
 }
 
+// Chase-Lev work-stealing deque, with the memory orderings of Le et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models". Only the
+// owner pushes and pops at the bottom; thieves steal from the top. Arrays
+// outgrown by push are kept until destruction, as thieves may still read
+// them.
+template <class T>
+class WorkStealingDeque {
+ public:
+  explicit WorkStealingDeque(size_t capacity = 256)
+      : top(0), bottom(0), array(new Array(capacity)) {}
+  WorkStealingDeque(WorkStealingDeque const&) = delete;
+  WorkStealingDeque& operator=(WorkStealingDeque const&) = delete;
+  ~WorkStealingDeque() {
+    delete array.load();
+    for (Array* retiredArray : retired) delete retiredArray;
+  }
+
+  void push(T item) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->mask) a = grow(a, t, b);
+    a->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  bool pop(T& item) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array* a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    bool found = t <= b;
+    if (found) {
+      item = a->get(b);
+      if (t == b) {
+        // last item: race the thieves for it
+        found = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                            std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return found;
+  }
+
+  bool steal(T& item) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return false;
+
+    item = array.load(std::memory_order_acquire)->get(t);
+    return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed);
+  }
+
+ private:
+  struct Array {
+    explicit Array(size_t capacity)
+        : mask(capacity - 1), items(new std::atomic<T>[capacity]) {}
+    T get(int64_t i) { return items[i & mask].load(std::memory_order_relaxed); }
+    void put(int64_t i, T item) {
+      items[i & mask].store(item, std::memory_order_relaxed);
+    }
+
+    int64_t mask;
+    std::unique_ptr<std::atomic<T>[]> items;
+  };
+
+  std::atomic<int64_t> top;
+  std::atomic<int64_t> bottom;
+  std::atomic<Array*> array;
+  std::vector<Array*> retired;
+
+  Array* grow(Array* a, int64_t t, int64_t b) {
+    Array* bigger = new Array(2 * (a->mask + 1));
+    for (int64_t i = t; i < b; ++i) bigger->put(i, a->get(i));
+    retired.push_back(a);
+    array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+};
+
+// Drop-in alternative to ThreadPool with the same enqueue interface. Every
+// worker owns a deque: tasks enqueued from a worker go to its own deque and
+// are popped LIFO, idle workers steal FIFO from the others. Only external
+// submitters go through the shared injection queue.
+class WorkStealingPool : public ParallelAlgorithms<WorkStealingPool> {
+ public:
+  explicit WorkStealingPool(size_t,
+                            PoolOptions const& options = PoolOptions());
+  template <class F, class... Args>
+  auto enqueue(F&& f, Args&&... args)
+      -> std::future<typename std::result_of<F(Args...)>::type>;
+  // Fire and forget: queues f with no future to report its completion.
+  template <class F>
+  void submit(F&& f);
+  // A batch from a worker goes to its own deque, for the others to steal;
+  // any other batch is injected under one lock.
+  void enqueueBatch(std::vector<InlineTask>& batch);
+  // Puts batch[i] in the mailbox of worker owners[i] % size(), under one
+  // lock.
+  void enqueueBatch(std::vector<InlineTask>& batch,
+                    std::vector<size_t> const& owners);
+  // Runs a pending task on the calling thread, if there is one: from its
+  // own deque or mailbox for a worker, otherwise injected or stolen.
+  bool runPendingTask();
+  size_t size() const { return workers.size(); }
+  ~WorkStealingPool();
+
+ private:
+  typedef InlineTask Task;
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<WorkStealingDeque<Task*> > > deques;
+  // tasks from threads outside the pool
+  SlabQueue<Task*> injected;
+  // tasks tagged for one worker, with their counts for lock-free checks
+  std::vector<SlabQueue<Task*> > mailboxes;
+  std::vector<std::atomic<size_t> > mailboxSizes;
+  std::mutex queue_mutex;
+
+  // untagged tasks enqueued but not yet taken by a worker
+  std::atomic<size_t> pendingTasks;
+  std::atomic<size_t> sleepers;
+  std::mutex idle_mutex;
+  std::condition_variable condition;
+  bool stop;
+
+  // The deques hold pointers, so queued tasks live in TaskSlab blocks.
+  static Task* newTask(Task&& task) {
+    return new (TaskSlab::allocate(sizeof(Task))) Task(std::move(task));
+  }
+  static void deleteTask(Task* task) {
+    task->~Task();
+    TaskSlab::deallocate(task, sizeof(Task));
+  }
+
+  // Makes the tasks visible to the workers: in the deque of the calling
+  // worker, or in the injection queue for other threads.
+  void push(Task* const* tasks, size_t count);
+
+  // Whether worker has a task to take; see findTask.
+  bool hasTaskFor(size_t worker) {
+    if (pendingTasks > 0 || mailboxSizes[worker] > 0) return true;
+    for (auto& size : mailboxSizes) {
+      if (size >= STEAL_BACKLOG) return true;
+    }
+    return false;
+  }
+
+  // Takes, in order, a task from: the worker's own deque and mailbox, the
+  // injection queue, the other deques, and the mailbox of a worker with at
+  // least backlog tagged tasks. worker is deques.size() for threads outside
+  // the pool.
+  bool findTask(size_t worker, size_t backlog, Task*& task) {
+    if (worker < deques.size() && deques[worker]->pop(task)) {
+      --pendingTasks;
+      return true;
+    }
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      if (worker < mailboxes.size() && !mailboxes[worker].empty()) {
+        task = takeTagged(worker);
+        return true;
+      }
+      if (!injected.empty()) {
+        task = injected.front();
+        injected.pop();
+        --pendingTasks;
+        return true;
+      }
+    }
+    for (size_t i = 1; i <= deques.size(); ++i) {
+      size_t victim = (worker + i) % deques.size();
+      if (victim != worker && deques[victim]->steal(task)) {
+        --pendingTasks;
+        return true;
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    for (size_t victim = 0; victim < mailboxes.size(); ++victim) {
+      if (mailboxes[victim].size() >= backlog) {
+        task = takeTagged(victim);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Called with queue_mutex held.
+  Task* takeTagged(size_t worker) {
+    Task* task = mailboxes[worker].front();
+    mailboxes[worker].pop();
+    --mailboxSizes[worker];
+    return task;
+  }
+};
+
+inline WorkStealingPool::WorkStealingPool(size_t threads,
+                                          PoolOptions const& options)
+    : ParallelAlgorithms<WorkStealingPool>(threads, options),
+      mailboxes(threads),
+      mailboxSizes(threads),
+      pendingTasks(0),
+      sleepers(0),
+      stop(false) {
+  for (size_t i = 0; i < threads; ++i)
+    deques.emplace_back(new WorkStealingDeque<Task*>());
+  for (size_t i = 0; i < threads; ++i)
+    workers.emplace_back([this, i] {
+      startWorker(i);
+      for (;;) {
+        Task* task = nullptr;
+        if (findTask(i, STEAL_BACKLOG, task)) {
+          (*task)();
+          deleteTask(task);
+          continue;
+        }
+        if (spinUntil(idle, [this, i] { return hasTaskFor(i); })) continue;
+
+        std::unique_lock<std::mutex> lock(this->idle_mutex);
+        ++sleepers;
+        this->condition.wait(
+            lock, [this, i] { return this->stop || hasTaskFor(i); });
+        --sleepers;
+        if (this->stop && this->pendingTasks == 0 &&
+            this->mailboxSizes[i] == 0) {
+          return;
+        }
+      }
+    });
+}
+
+template <class F, class... Args>
+auto WorkStealingPool::enqueue(F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type> {
+  Task task;
+  auto res =
+      promisedTask(task, std::forward<F>(f), std::forward<Args>(args)...);
+  submit(std::move(task));
+  return res;
+}
+
+template <class F>
+void WorkStealingPool::submit(F&& f) {
+  Task* task = newTask(Task(std::forward<F>(f)));
+  push(&task, 1);
+}
+
+inline void WorkStealingPool::enqueueBatch(std::vector<Task>& batch) {
+  std::vector<Task*> wrapped;
+  wrapped.reserve(batch.size());
+  for (auto& task : batch) wrapped.push_back(newTask(std::move(task)));
+  push(wrapped.data(), wrapped.size());
+}
+
+inline void WorkStealingPool::push(Task* const* tasks, size_t count) {
+  // counted before they are visible, so a worker never takes one uncounted
+  pendingTasks += count;
+  if (currentPool() == this) {
+    for (size_t i = 0; i < count; ++i) deques[currentWorker()]->push(tasks[i]);
+  } else {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+
+    // don't allow enqueueing after stopping the pool
+    if (stop) {
+      pendingTasks -= count;
+      for (size_t i = 0; i < count; ++i) deleteTask(tasks[i]);
+      throw std::runtime_error("enqueue on stopped WorkStealingPool");
+    }
+
+    for (size_t i = 0; i < count; ++i) injected.push(tasks[i]);
+  }
+
+  if (sleepers > 0) {
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    if (count == 1) {
+      condition.notify_one();
+    } else {
+      condition.notify_all();
+    }
+  }
+}
+
+inline void WorkStealingPool::enqueueBatch(std::vector<Task>& batch,
+                                           std::vector<size_t> const& owners) {
+  std::vector<Task*> wrapped;
+  wrapped.reserve(batch.size());
+  for (auto& task : batch) wrapped.push_back(newTask(std::move(task)));
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+
+    if (stop) {
+      for (Task* task : wrapped) deleteTask(task);
+      throw std::runtime_error("enqueue on stopped WorkStealingPool");
+    }
+
+    for (size_t i = 0; i < wrapped.size(); ++i) {
+      size_t owner = owners[i] % mailboxes.size();
+      mailboxes[owner].push(wrapped[i]);
+      ++mailboxSizes[owner];
+    }
+  }
+
+  if (sleepers > 0) {
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    condition.notify_all();
+  }
+}
+
+// A helping thread may take any tagged task: it would otherwise block on
+// work that is queued behind a busy worker.
+inline bool WorkStealingPool::runPendingTask() {
+  size_t worker = currentPool() == this ? currentWorker() : deques.size();
+  Task* task = nullptr;
+  if (!findTask(worker, 1, task)) return false;
+  (*task)();
+  deleteTask(task);
+  return true;
+}
+
+inline WorkStealingPool::~WorkStealingPool() {
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    std::unique_lock<std::mutex> idleLock(idle_mutex);
+    stop = true;
+  }
+  condition.notify_all();
+  for (std::thread& worker : workers) worker.join();
+}
+
+// The process-wide pool of type Pool, with a worker per hardware thread,
+// started on first use. It is never destroyed, so that it outlives every
+// static that may still submit to it.
+template <class Pool>
+Pool& sharedPool() {
+  static Pool* pool =
+      new Pool(std::max<size_t>(std::thread::hardware_concurrency(), 1));
+  return *pool;
+}
+
+// A part of a pool for one of its users, so that several users share the
+// workers instead of each starting threads of its own. Loops of a share run
+// on at most limit threads, the calling one included, and its affine loops
+// tag other workers than those of other shares. At most limit of its
+// enqueued tasks are in the pool at a time; the rest wait in the share, in
+// order. Tasks enqueued by a task of the share skip that wait, since their
+// caller may block on them.
+template <class Pool>
+class PoolShare {
+ public:
+  PoolShare(Pool& poolArg, size_t limitArg)
+      : pool(poolArg),
+        limit(std::max<size_t>(limitArg, 1)),
+        firstOwner(pool.claimOwners(limit - 1)),
+        backlog(std::make_shared<Backlog>()) {}
+
+  template <class F, class... Args>
+  auto enqueue(F&& f, Args&&... args)
+      -> std::future<typename std::result_of<F(Args...)>::type> {
+    if (Runner::current() == backlog.get()) {
+      return pool.enqueue(std::forward<F>(f), std::forward<Args>(args)...);
+    }
+    InlineTask task;
+    auto res =
+        promisedTask(task, std::forward<F>(f), std::forward<Args>(args)...);
+    {
+      std::lock_guard<std::mutex> lock(backlog->backlog_mutex);
+      if (backlog->inFlight == limit) {
+        backlog->tasks.push(std::move(task));
+        return res;
+      }
+      ++backlog->inFlight;
+    }
+    pool.submit(Runner(backlog, std::move(task)));
+    return res;
+  }
+
+  template <class F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F const& fn) {
+    pool.parallel_for(begin, end, grain, fn, limit);
+  }
+
+  template <class F>
+  void parallel_for_affine(size_t begin, size_t end, size_t grain,
+                           F const& fn) {
+    pool.parallel_for_affine(begin, end, grain, fn, limit, firstOwner);
+  }
+
+  template <class T, class Map, class Combine>
+  T parallel_reduce(size_t begin, size_t end, size_t grain, T identity,
+                    Map const& map, Combine const& combine) {
+    return pool.parallel_reduce(begin, end, grain, identity, map, combine,
+                                limit);
+  }
+
+  template <class T>
+  void waitHelping(std::future<T> const& future) {
+    pool.waitHelping(future);
+  }
+
+  double taskNanos() { return pool.taskNanos(); }
+
+  // Threads that can run a loop of the share at once: the caller and the
+  // workers of the pool, up to limit.
+  size_t threads() const { return std::min(limit, pool.size() + 1); }
+
+  size_t size() const { return limit; }
+
+ private:
+  // Enqueued tasks of the share; outlives the share while any of them runs.
+  struct Backlog {
+    Backlog() : inFlight(0) {}
+
+    std::mutex backlog_mutex;
+    SlabQueue<InlineTask> tasks;
+    size_t inFlight;
+  };
+
+  // One of the tasks in flight: runs its task and then those waiting in
+  // the backlog, until there are none left.
+  struct Runner {
+    Runner(std::shared_ptr<Backlog> const& backlogArg, InlineTask taskArg)
+        : backlog(backlogArg), task(std::move(taskArg)) {}
+
+    // The backlog whose task the calling thread runs, if any.
+    static Backlog*& current() {
+      static thread_local Backlog* running = nullptr;
+      return running;
+    }
+
+    void operator()() {
+      Backlog* outer = current();
+      current() = backlog.get();
+      while (true) {
+        task();
+        std::lock_guard<std::mutex> lock(backlog->backlog_mutex);
+        if (backlog->tasks.empty()) {
+          --backlog->inFlight;
+          current() = outer;
+          return;
+        }
+        task = std::move(backlog->tasks.front());
+        backlog->tasks.pop();
+      }
+    }
+
+    std::shared_ptr<Backlog> backlog;
+    InlineTask task;
+  };
+
+  Pool& pool;
+  size_t limit;
+  size_t firstOwner;
+  std::shared_ptr<Backlog> backlog;
+};
+
 #endif